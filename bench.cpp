@@ -0,0 +1,212 @@
+#include "CLI/CLI.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+// reference stacks, chosen to cover the different regimes: deep penetration, thick high-Z shield, thin layer
+struct Scenario {
+    string name;
+    string material;
+    double thickness; // mm
+    string particle;
+};
+
+const vector<Scenario> scenarios = {
+        {"concrete_1m_neutron", "G4_CONCRETE", 1000, "neutron"},
+        {"lead_10cm_muon", "G4_Pb", 100, "muon"},
+        {"water_1mm_gamma", "G4_WATER", 1, "gamma"},
+};
+
+// values of the flat JSON object written by 'radiation-transmission --timing'
+map<string, string> readTiming(const filesystem::path &filename) {
+    ifstream file(filename);
+    if (!file) {
+        throw runtime_error("Could not read " + filename.string());
+    }
+    map<string, string> values;
+    string line;
+    while (getline(file, line)) {
+        const auto separator = line.find(':');
+        if (separator == string::npos) {
+            continue;
+        }
+        auto key = line.substr(0, separator);
+        auto value = line.substr(separator + 1);
+        key = key.substr(key.find('"') + 1);
+        key = key.substr(0, key.find('"'));
+        value = value.substr(value.find_first_not_of(' '));
+        value = value.substr(0, value.find_last_not_of(", ") + 1);
+        values[key] = value;
+    }
+    return values;
+}
+
+// "[0.1, 0.2]"
+vector<double> parseList(const string &list) {
+    vector<double> values;
+    istringstream stream(list.substr(1, list.size() - 2));
+    string value;
+    while (getline(stream, value, ',')) {
+        values.push_back(stod(value));
+    }
+    return values;
+}
+
+int main(int argc, char **argv) {
+    string executable = BENCH_EXECUTABLE;
+    string inputFilename = BENCH_INPUT;
+    string outputFilename;
+    int nEvents = 10000;
+    unsigned int maxThreads = thread::hardware_concurrency();
+    vector<string> scorings = {"volume"};
+    vector<string> runManagers = {"mt"};
+    int eventModulo = 0;
+
+    CLI::App app{"radiation-transmission-bench"};
+
+    app.add_option("-n,--primaries", nEvents, "Number of primary particles to launch in each scenario")->check(
+            CLI::PositiveNumber);
+    app.add_option("-t,--max-threads", maxThreads,
+                   "Maximum number of threads, each scenario runs with 1, 2, 4 ... threads up to this value")->check(
+            CLI::PositiveNumber);
+    app.add_option("-o,--output", outputFilename, "Output JSON filename (standard output if not set)");
+    app.add_option("-i,--input", inputFilename, "Input root filename with particle energy / angle information")->check(
+            CLI::ExistingFile);
+    app.add_option("--scoring", scorings,
+                   "Scoring modes to run each scenario with ('--scoring volume --scoring plane' compares the per hit cost of both)")->check(
+            CLI::IsMember({"volume", "plane"}))->capture_default_str();
+    app.add_option("--run-manager", runManagers,
+                   "Run managers to run each scenario with ('--run-manager mt --run-manager tasking' compares how well they balance the threads)")->check(
+            CLI::IsMember({"mt", "tasking"}))->capture_default_str();
+    app.add_option("--event-modulo", eventModulo, "Number of events a thread takes at a time (default: Geant4's)")->check(
+            CLI::PositiveNumber);
+    app.add_option("--executable", executable, "radiation-transmission executable")->check(CLI::ExistingFile);
+
+    CLI11_PARSE(app, argc, argv)
+
+    vector<unsigned int> threads;
+    for (unsigned int n = 1; n < maxThreads; n *= 2) {
+        threads.push_back(n);
+    }
+    threads.push_back(maxThreads);
+
+    const auto directory = filesystem::temp_directory_path() / ("radiation-transmission-bench-" + to_string(getpid()));
+    filesystem::create_directories(directory);
+
+    string geant4Version;
+    ostringstream results;
+    // event loop time per hit of each scoring mode, per scenario, run manager and thread count
+    map<tuple<string, string, unsigned int>, map<string, double>> usPerHit;
+    for (const auto &scenario: scenarios) {
+        for (const auto &scoring: scorings) {
+            for (const auto &runManager: runManagers) {
+                for (const auto n: threads) {
+                    cerr << "Running " << scenario.name << " with " << n << " threads (" << scoring << " scoring, "
+                         << runManager << " run manager)" << endl;
+
+                    const auto timingFilename = directory / "timing.json";
+                    filesystem::remove(timingFilename);
+
+                    const auto logName = scenario.name + "_" + scoring + "_" + runManager + "_" + to_string(n) + ".log";
+                    ostringstream command;
+                    command << "'" << executable << "'"
+                            << " -n " << nEvents << " -t " << n << " -p " << scenario.particle
+                            << " -i '" << inputFilename << "'"
+                            << " -o '" << (directory / "output.root").string() << "'"
+                            << " -d " << scenario.material << " " << scenario.thickness
+                            << " --seed 1"
+                            << " --scoring " << scoring
+                            << " --run-manager " << runManager;
+                    if (eventModulo > 0) {
+                        command << " --event-modulo " << eventModulo;
+                    }
+                    command << " --timing '" << timingFilename.string() << "'"
+                            << " > '" << (directory / logName).string() << "'";
+                    if (system(command.str().c_str()) != 0) {
+                        throw runtime_error("Scenario " + scenario.name + " failed, see the logs in " + directory.string());
+                    }
+
+                    auto timing = readTiming(timingFilename);
+                    geant4Version = timing["geant4_version"];
+                    const auto eventLoop = stod(timing["event_loop_s"]);
+                    const auto primaries = stod(timing["primaries"]);
+                    const auto secondaries = stod(timing["secondaries"]);
+                    // time the threads spent waiting for the slowest one at the end of the runs
+                    const auto tailIdle = parseList(timing["tail_idle_s"]);
+                    const auto tailIdleMax = tailIdle.empty() ? 0 : *max_element(tailIdle.begin(), tailIdle.end());
+                    if (secondaries > 0) {
+                        usPerHit[{scenario.name, runManager, n}][scoring] = 1E6 * eventLoop / secondaries;
+                    }
+
+                    results << (results.tellp() > 0 ? ",\n" : "")
+                            << "    {\"scenario\": \"" << scenario.name << "\", "
+                            << "\"material\": \"" << scenario.material << "\", "
+                            << "\"thickness_mm\": " << scenario.thickness << ", "
+                            << "\"particle\": \"" << scenario.particle << "\", "
+                            << "\"scoring\": \"" << scoring << "\", "
+                            << "\"run_manager\": \"" << runManager << "\", "
+                            << "\"event_modulo\": " << timing["event_modulo"] << ", "
+                            << "\"threads\": " << n << ", "
+                            << "\"primaries\": " << timing["primaries"] << ", "
+                            << "\"secondaries\": " << timing["secondaries"] << ", "
+                            << "\"initialization_s\": " << timing["initialization_s"] << ", "
+                            << "\"event_loop_s\": " << timing["event_loop_s"] << ", "
+                            << "\"events_per_s\": " << primaries / eventLoop << ", "
+                            << "\"hits_per_s\": " << secondaries / eventLoop << ", "
+                            << "\"event_loop_us_per_hit\": " << (secondaries > 0 ? 1E6 * eventLoop / secondaries : 0) << ", "
+                            << "\"tail_idle_s\": " << timing["tail_idle_s"] << ", "
+                            << "\"tail_idle_max_s\": " << tailIdleMax << ", "
+                            << "\"tail_idle_fraction\": " << (eventLoop > 0 ? tailIdleMax / eventLoop : 0) << "}";
+                }
+            }
+        }
+    }
+
+    filesystem::remove_all(directory);
+
+    // the cost per hit of the scoring plane against the one of the detector volume, when both were run
+    ostringstream comparison;
+    for (const auto &[key, modes]: usPerHit) {
+        if (modes.count("volume") == 0 || modes.count("plane") == 0) {
+            continue;
+        }
+        const auto &[scenarioName, runManager, n] = key;
+        const double volume = modes.at("volume");
+        const double plane = modes.at("plane");
+        comparison << (comparison.tellp() > 0 ? ",\n" : "")
+                   << "    {\"scenario\": \"" << scenarioName << "\", "
+                   << "\"run_manager\": \"" << runManager << "\", "
+                   << "\"threads\": " << n << ", "
+                   << "\"volume_us_per_hit\": " << volume << ", "
+                   << "\"plane_us_per_hit\": " << plane << ", "
+                   << "\"plane_minus_volume_us_per_hit\": " << plane - volume << ", "
+                   << "\"plane_over_volume\": " << plane / volume << "}";
+    }
+
+    ostringstream json;
+    json << "{\n"
+         << "  \"geant4_version\": " << geant4Version << ",\n"
+         << "  \"results\": [\n" << results.str() << "\n  ]";
+    if (comparison.tellp() > 0) {
+        json << ",\n  \"scoring_comparison\": [\n" << comparison.str() << "\n  ]";
+    }
+    json << "\n}" << endl;
+
+    if (outputFilename.empty()) {
+        cout << json.str();
+    } else {
+        ofstream(outputFilename) << json.str();
+    }
+
+    return 0;
+}
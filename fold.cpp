@@ -0,0 +1,271 @@
+#include "InputParticle.h"
+#include "OutputHistograms.h"
+#include "ResponseMatrixNames.h"
+
+#include "CLI/CLI.hpp"
+
+#include <TFile.h>
+#include <TH1.h>
+#include <TH2D.h>
+#include <THnSparse.h>
+#include <TKey.h>
+#include <TList.h>
+#include <TNamed.h>
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+namespace {
+// written by the simulation with '--response'
+string getPrimariesName(InputParticle input) {
+    return ResponseMatrixNames::GetPrimariesName(ResponseMatrixNames::Grid::output, input);
+}
+
+string getResponseName(InputParticle input, OutputParticle output) {
+    return ResponseMatrixNames::GetResponseName(ResponseMatrixNames::Grid::output, input, GetOutputParticleName(output));
+}
+
+bool hasResponse(TDirectory *directory) {
+    for (const auto input: inputParticlesAll) {
+        if (directory->GetListOfKeys()->FindObject(getPrimariesName(input).c_str()) != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// directories holding matrices: the top level for a single configuration, one directory per configuration for scans
+vector<string> getResponseDirectories(TFile *file) {
+    if (hasResponse(file)) {
+        return {""};
+    }
+    vector<string> directories;
+    for (const auto object: *file->GetListOfKeys()) {
+        const auto key = (TKey *) object;
+        if (string(key->GetClassName()) != "TDirectoryFile") {
+            continue;
+        }
+        if (hasResponse(file->GetDirectory(key->GetName()))) {
+            directories.emplace_back(key->GetName());
+        }
+    }
+    return directories;
+}
+
+bool haveSameBinning(const TAxis &axis, const TAxis &other) {
+    if (axis.GetNbins() != other.GetNbins()) {
+        return false;
+    }
+    for (int i = 1; i <= axis.GetNbins() + 1; ++i) {
+        const double edge = axis.GetBinLowEdge(i);
+        if (abs(edge - other.GetBinLowEdge(i)) > 1E-9 * max(1.0, abs(edge))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// output(E, zenith) = sum over input species and input bins of flux(bin) / primaries(bin) * response(bin, E, zenith)
+void fold(TDirectory *responseDirectory, const map<InputParticle, unique_ptr<TH2D>> &spectra,
+          OutputHistograms &output, double &missedFlux, double &totalFlux) {
+    for (const auto &[input, spectrum]: spectra) {
+        const auto primaries = unique_ptr<TH2D>(responseDirectory->Get<TH2D>(getPrimariesName(input).c_str()));
+        if (!primaries) {
+            throw runtime_error("No response matrix for " + GetInputParticleName(input) + " in " +
+                                responseDirectory->GetName());
+        }
+        if (!haveSameBinning(*primaries->GetXaxis(), *spectrum->GetXaxis()) ||
+            !haveSameBinning(*primaries->GetYaxis(), *spectrum->GetYaxis())) {
+            throw runtime_error("The " + GetInputParticleName(input) +
+                                " spectrum does not have the binning of the response matrix");
+        }
+
+        // scale of each input bin, flux in bins that were never sampled cannot be folded
+        const int energyBinsN = primaries->GetNbinsX();
+        const int zenithBinsN = primaries->GetNbinsY();
+        vector<double> factors((energyBinsN + 2) * (zenithBinsN + 2), 0);
+        for (int j = 1; j <= zenithBinsN; ++j) {
+            for (int i = 1; i <= energyBinsN; ++i) {
+                const double flux = max(0.0, spectrum->GetBinContent(i, j));
+                const double launched = primaries->GetBinContent(i, j);
+                totalFlux += flux;
+                if (launched > 0) {
+                    factors[j * (energyBinsN + 2) + i] = flux / launched;
+                } else {
+                    missedFlux += flux;
+                }
+            }
+        }
+
+        for (const auto particle: outputParticlesAll) {
+            const auto response = unique_ptr<THnSparse>(
+                    responseDirectory->Get<THnSparse>(getResponseName(input, particle).c_str()));
+            if (!response) {
+                throw runtime_error(getResponseName(input, particle) + " not found in " +
+                                    responseDirectory->GetName());
+            }
+            auto energyZenith = output.energyZenithHists[ToIndex(particle)];
+
+            // only the filled bins are visited
+            array<int, 4> coordinates = {};
+            for (Long64_t bin = 0; bin < response->GetNbins(); ++bin) {
+                const double content = response->GetBinContent(bin, coordinates.data());
+                const double factor = factors[coordinates[1] * (energyBinsN + 2) + coordinates[0]];
+                if (factor == 0) {
+                    continue;
+                }
+                const auto [i, j] = pair<int, int>{coordinates[2], coordinates[3]};
+                const double error = energyZenith->GetBinError(i, j);
+                energyZenith->SetBinContent(i, j, energyZenith->GetBinContent(i, j) + content * factor);
+                energyZenith->SetBinError(i, j, sqrt(error * error + response->GetBinError2(bin) * factor * factor));
+            }
+        }
+    }
+
+    // the one dimensional distributions are the projections of the folded ones
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        const auto energyZenith = output.energyZenithHists[index];
+        for (int i = 0; i <= energyZenith->GetNbinsX() + 1; ++i) {
+            for (int j = 0; j <= energyZenith->GetNbinsY() + 1; ++j) {
+                const double content = energyZenith->GetBinContent(i, j);
+                if (content == 0) {
+                    continue;
+                }
+                const double error = energyZenith->GetBinError(i, j);
+                for (const auto &[hist, bin]: {pair<TH1D *, int>{output.energyHists[index], i},
+                                               pair<TH1D *, int>{output.zenithHists[index], j}}) {
+                    hist->AddBinContent(bin, content);
+                    hist->SetBinError(bin, hypot(hist->GetBinError(bin), error));
+                }
+            }
+        }
+    }
+}
+} // namespace
+
+int main(int argc, char **argv) {
+    string responseFilename;
+    string spectrumFilename;
+    string outputFilename;
+    set<string> inputParticleNames;
+
+    CLI::App app{"radiation-transmission-fold"};
+
+    app.add_option("response", responseFilename, "Root file written with '--response'")->required()->check(
+            CLI::ExistingFile);
+    app.add_option("-o,--output", outputFilename, "Output root filename")->required();
+    app.add_option("-i,--input", spectrumFilename,
+                   "Input root filename with the particle energy / zenith distributions (e.g. 'cry.root'), with the same binning as the input used for the response matrix (default: that input)")->check(
+            CLI::ExistingFile);
+    app.add_option("-p,--particle", inputParticleNames,
+                   "Input particles to fold (default: all the particles of the response matrix)")->check(
+            CLI::IsMember({"neutron", "gamma", "proton", "electron", "muon"}));
+
+    CLI11_PARSE(app, argc, argv)
+
+    const auto timeStart = chrono::steady_clock::now();
+
+    TH1::AddDirectory(false);
+    TH1::SetDefaultSumw2(true);
+
+    auto responseFile = unique_ptr<TFile>(TFile::Open(responseFilename.c_str(), "READ"));
+    if (!responseFile || responseFile->IsZombie()) {
+        throw runtime_error("Could not open " + responseFilename);
+    }
+    const auto directories = getResponseDirectories(responseFile.get());
+    if (directories.empty()) {
+        throw runtime_error("No response matrix found in " + responseFilename + ", not written with '--response'");
+    }
+
+    // the spectra are the input distributions of the response file unless another input is given
+    auto spectrumFile = spectrumFilename.empty() ? nullptr : unique_ptr<TFile>(
+            TFile::Open(spectrumFilename.c_str(), "READ"));
+    if (!spectrumFilename.empty() && (!spectrumFile || spectrumFile->IsZombie())) {
+        throw runtime_error("Could not open " + spectrumFilename);
+    }
+    TFile *source = spectrumFile ? spectrumFile.get() : responseFile.get();
+    const string prefix = spectrumFile ? "" : "input_";
+
+    map<InputParticle, unique_ptr<TH2D>> spectra;
+    const auto firstDirectory = directories.front().empty() ? (TDirectory *) responseFile.get()
+                                                             : responseFile->GetDirectory(directories.front().c_str());
+    for (const auto input: inputParticlesAll) {
+        const auto name = GetInputParticleName(input);
+        if (!inputParticleNames.empty() && inputParticleNames.count(name) == 0) {
+            continue;
+        }
+        if (firstDirectory->GetListOfKeys()->FindObject(getPrimariesName(input).c_str()) == nullptr) {
+            if (!inputParticleNames.empty()) {
+                throw runtime_error("No response matrix for " + name + " in " + responseFilename);
+            }
+            continue;
+        }
+        spectra[input].reset(source->Get<TH2D>((prefix + name + "_energy_zenith").c_str()));
+        if (!spectra[input]) {
+            throw runtime_error(prefix + name + "_energy_zenith not found in " + source->GetName());
+        }
+    }
+
+    auto outputFile = unique_ptr<TFile>(TFile::Open(outputFilename.c_str(), "RECREATE"));
+    if (!outputFile || outputFile->IsZombie()) {
+        throw runtime_error("Could not create " + outputFilename);
+    }
+
+    for (const auto &directoryName: directories) {
+        const auto responseDirectory = directoryName.empty() ? (TDirectory *) responseFile.get()
+                                                             : responseFile->GetDirectory(directoryName.c_str());
+
+        OutputHistograms output;
+        double missedFlux = 0;
+        double totalFlux = 0;
+        fold(responseDirectory, spectra, output, missedFlux, totalFlux);
+
+        const auto detector = unique_ptr<TNamed>(responseDirectory->Get<TNamed>("detector"));
+        cout << (directoryName.empty() ? (detector ? detector->GetTitle() : "") : directoryName)
+             << ": flux (counts / s / m2): " << output.GetIntegral() << endl;
+        if (missedFlux > 0) {
+            cerr << "Warning: " << 100 * missedFlux / totalFlux
+                 << "% of the input flux is in bins without any primary in the response matrix, it is not folded"
+                 << endl;
+        }
+
+        TDirectory *directory = outputFile.get();
+        if (!directoryName.empty()) {
+            directory = outputFile->mkdir(directoryName.c_str(), responseDirectory->GetTitle());
+        }
+        output.Write(directory);
+    }
+
+    // input information, as in the output of a regular run
+    outputFile->cd();
+    if (const auto physics = unique_ptr<TNamed>(responseFile->Get<TNamed>("physics"))) {
+        physics->Write();
+    }
+    if (const auto latitude = unique_ptr<TNamed>(source->Get<TNamed>("latitude"))) {
+        latitude->Write();
+    }
+    for (const auto &[input, spectrum]: spectra) {
+        const auto name = GetInputParticleName(input);
+        for (const auto &suffix: {"_energy", "_zenith", "_energy_zenith"}) {
+            const auto hist = unique_ptr<TH1>(source->Get<TH1>((prefix + name + suffix).c_str()));
+            if (hist) {
+                hist->SetName(("input_" + name + suffix).c_str());
+                hist->Write();
+            }
+        }
+    }
+
+    outputFile->Close();
+
+    cout << "Folded in " << chrono::duration<double>(chrono::steady_clock::now() - timeStart).count() << " s" << endl;
+
+    return 0;
+}
@@ -1,51 +1,360 @@
+#include <G4GeometrySampler.hh>
+#include <G4ImportanceBiasing.hh>
 #include <G4RunManager.hh>
 #include <G4RunManagerFactory.hh>
+#include <G4MTRunManager.hh>
+#include <G4TaskRunManager.hh>
+#include <G4Version.hh>
 
 #include "DetectorConstruction.h"
 #include "PhysicsList.h"
 #include "ActionInitialization.h"
 #include "RunAction.h"
+#include "ResponseMatrix.h"
+#include "AdaptiveStopping.h"
+#include "StackingAction.h"
+#include "SteppingAction.h"
+#include "Checkpoint.h"
+#include "CompiledInput.h"
+#include "InputCache.h"
+#include "JobServer.h"
+#include "LayerStack.h"
+#include "HitRecorder.h"
+#include "Metrics.h"
+#include "Random.h"
 
 #include "CLI/CLI.hpp"
 
+#include <Randomize.hh>
+
+#include <TFile.h>
+#include <TH1.h>
+#include <TMD5.h>
+#include <TNamed.h>
+#include <TROOT.h>
+
 #include <chrono>
+#include <fstream>
 #include <iostream>
-#include <thread>
+#include <map>
+#include <optional>
+#include <sstream>
 #include <filesystem>
+#include <unistd.h>
 
 using namespace std;
 
-void printProgress() {
-    const auto start = chrono::steady_clock::now();
-    // lambda to check if the condition has been met (RunAction::GetLaunchedPrimaries() < RunAction::GetRequestedPrimaries()) or (RunAction::GetSecondariesCount() < RunAction::GetRequestedSecondaries())
+using DetectorConfiguration = vector<pair<string, double>>;
 
-    auto checkCondition = []() {
-        if (RunAction::GetRequestedPrimaries() > 0) {
-            return RunAction::GetLaunchedPrimaries() < RunAction::GetRequestedPrimaries();
-        } else {
-            return RunAction::GetSecondariesCount() < RunAction::GetRequestedSecondaries();
+// e.g. "G4_Pb_100mm_G4_WATER_10mm", used as directory name in the output file
+string getConfigurationName(const DetectorConfiguration &configuration) {
+    string name;
+    for (const auto &[material, thickness]: configuration) {
+        ostringstream layer;
+        layer << material << "_" << thickness << "mm";
+        name += (name.empty() ? "" : "_") + layer.str();
+    }
+    return name;
+}
+
+// e.g. "G4_Pb 100 mm, G4_WATER 10 mm"
+string getConfigurationTitle(const DetectorConfiguration &configuration) {
+    string title;
+    for (const auto &[material, thickness]: configuration) {
+        ostringstream layer;
+        layer << material << " " << thickness << " mm";
+        title += (title.empty() ? "" : ", ") + layer.str();
+    }
+    return title;
+}
+
+// "start:stop:step" in mm, stop included
+vector<double> parseScanRange(const string &range) {
+    vector<double> values;
+    istringstream stream(range);
+    string token;
+    while (getline(stream, token, ':')) {
+        values.push_back(stod(token));
+    }
+    if (values.size() != 3 || values[2] <= 0 || values[1] < values[0]) {
+        throw runtime_error("Invalid scan range '" + range + "', expected 'start:stop:step' with step > 0");
+    }
+    const auto [start, stop, step] = tuple{values[0], values[1], values[2]};
+    vector<double> thicknesses;
+    const auto n = (size_t) ((stop - start) / step + 1E-9) + 1;
+    for (size_t i = 0; i < n; i++) {
+        thicknesses.push_back(start + (double) i * step);
+    }
+    return thicknesses;
+}
+
+// "i/N", shards are numbered from 0
+pair<unsigned int, unsigned int> parseShard(const string &shard) {
+    const auto separator = shard.find('/');
+    if (separator == string::npos) {
+        throw runtime_error("Invalid shard '" + shard + "', expected 'i/N'");
+    }
+    const auto index = stoul(shard.substr(0, separator));
+    const auto count = stoul(shard.substr(separator + 1));
+    if (count == 0 || index >= count) {
+        throw runtime_error("Invalid shard '" + shard + "', expected 'i/N' with 0 <= i < N");
+    }
+    return {index, count};
+}
+
+// share of a total split as evenly as possible across shards
+int getShardShare(int total, unsigned int index, unsigned int count) {
+    return total / (int) count + ((int) index < total % (int) count ? 1 : 0);
+}
+
+// physics tables only depend on the Geant4 version, the physics list and the materials, in order of creation
+filesystem::path getPhysicsCacheDirectory(const string &cacheDirectory, const string &physics,
+                                          const DetectorConfiguration &configuration) {
+    string key = string(G4Version) + "\n" + physics + "\nG4_Galactic";
+    set<string> materials;
+    for (const auto &[material, thickness]: configuration) {
+        if (thickness > 0 && materials.insert(material).second) {
+            key += "\n" + material;
+        }
+    }
+    TMD5 md5;
+    md5.Update((const UChar_t *) key.data(), key.size());
+    md5.Final();
+    return filesystem::path(cacheDirectory) / md5.AsString();
+}
+
+// transfer operators depend on the Geant4 version, the simulation settings (physics, input binning, statistics) and
+// the layers. e.g. "G4_Pb_100mm_<md5>.root"
+filesystem::path getLayerCacheFilename(const string &cacheDirectory, const string &settings,
+                                       const DetectorConfiguration &configuration) {
+    const string key = string(G4Version) + "\n" + settings + "\n" + getConfigurationName(configuration);
+    TMD5 md5;
+    md5.Update((const UChar_t *) key.data(), key.size());
+    md5.Final();
+    return filesystem::path(cacheDirectory) / (getConfigurationName(configuration) + "_" + md5.AsString() + ".root");
+}
+
+// applies the cached operators of the layers from top to bottom, and compares with the operator of the whole stack
+// when 'directFilename' is given
+void composeStack(const LayerStack::Spectra &input, const vector<filesystem::path> &layerFilenames,
+                  const filesystem::path &directFilename, const string &latitude, const string &title,
+                  const string &outputFilename) {
+    double totalFlux = 0;
+    for (const auto &spectrum: input) {
+        totalFlux += spectrum->Integral();
+    }
+
+    auto applyLayers = [&input](const vector<filesystem::path> &filenames, double &lostFlux) {
+        LayerStack::Spectra spectra;
+        for (size_t i = 0; i < input.size(); i++) {
+            spectra[i].reset((TH2D *) input[i]->Clone());
         }
+        for (const auto &filename: filenames) {
+            const auto layer = unique_ptr<TFile>(TFile::Open(filename.c_str(), "READ"));
+            if (!layer || layer->IsZombie()) {
+                throw runtime_error("Could not open cached layer " + filename.string());
+            }
+            spectra = LayerStack::Apply(layer.get(), spectra, lostFlux);
+        }
+        return spectra;
     };
 
-    cout << "Requested primaries: " << RunAction::GetRequestedPrimaries() << endl;
-    cout << "Requested secondaries: " << RunAction::GetRequestedSecondaries() << endl;
+    double lostFlux = 0;
+    const auto composed = applyLayers(layerFilenames, lostFlux);
+
+    double composedFlux = 0;
+    for (const auto &spectrum: composed) {
+        composedFlux += spectrum->Integral();
+    }
+    cout << "Composed " << layerFilenames.size() << " layers (" << title << "), flux (counts / s / m2): "
+         << composedFlux << endl;
+    if (lostFlux > 0 && totalFlux > 0) {
+        cerr << "Warning: " << 100 * lostFlux / totalFlux
+             << "% of the input flux is lost in bins without any simulated primary or out of the binning" << endl;
+    }
+
+    auto outputFile = unique_ptr<TFile>(TFile::Open(outputFilename.c_str(), "RECREATE"));
+    if (!outputFile || outputFile->IsZombie()) {
+        throw runtime_error("Could not create " + outputFilename);
+    }
+    LayerStack::Write(outputFile.get(), composed);
+    LayerStack::Write(outputFile.get(), input, "input_");
+    if (!directFilename.empty()) {
+        double directLostFlux = 0;
+        const auto direct = applyLayers({directFilename}, directLostFlux);
+        LayerStack::Write(outputFile.get(), direct, "direct_");
+        LayerStack::Compare(outputFile.get(), composed, direct);
+    }
+    outputFile->cd();
+    TNamed("detector", title.c_str()).Write();
+    TNamed("latitude", latitude.c_str()).Write();
+    outputFile->Close();
+}
 
-    do {
-        const auto elapsed = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - start).count();
-        if (RunAction::GetRequestedPrimaries() > 0) {
-            const auto count = RunAction::GetLaunchedPrimaries();
-            cout << "Progress (primaries): " << count << " / " << RunAction::GetRequestedPrimaries()
-                 << " (" << 100.0 * double(count) / RunAction::GetRequestedPrimaries() << "%)"
-                 << " Elapsed time: " << elapsed << " s" << endl;
+// one configuration per line, in the same format as '-d': "G4_Pb 100 G4_WATER 10". Empty lines and '#' comments are skipped
+vector<DetectorConfiguration> readScanFile(const string &filename) {
+    vector<DetectorConfiguration> configurations;
+    ifstream file(filename);
+    string line;
+    while (getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream stream(line);
+        DetectorConfiguration configuration;
+        string material;
+        double thickness;
+        while (stream >> material) {
+            if (!(stream >> thickness)) {
+                throw runtime_error("Invalid line in scan file " + filename + ": '" + line + "'");
+            }
+            configuration.emplace_back(material, thickness);
+        }
+        if (!configuration.empty()) {
+            configurations.push_back(configuration);
+        }
+    }
+    return configurations;
+}
+
+// configurations of a run, from '-d', '--scan' or '--scan-file'
+vector<DetectorConfiguration> getConfigurations(const DetectorConfiguration &detectorConfiguration,
+                                                const vector<string> &scan, const string &scanFilename) {
+    vector<DetectorConfiguration> configurations;
+    if (!scan.empty()) {
+        for (const auto thickness: parseScanRange(scan[1])) {
+            auto configuration = detectorConfiguration;
+            configuration.emplace_back(scan[0], thickness);
+            configurations.push_back(configuration);
+        }
+    } else if (!scanFilename.empty()) {
+        configurations = readScanFile(scanFilename);
+        if (configurations.empty()) {
+            throw runtime_error("Scan file " + scanFilename + " contains no detector configurations");
+        }
+    } else if (!detectorConfiguration.empty()) {
+        configurations = {detectorConfiguration};
+    } else {
+        throw runtime_error("A detector configuration must be defined with '-d', '--scan' or '--scan-file'");
+    }
+
+    set<string> configurationNames;
+    for (const auto &configuration: configurations) {
+        if (!configurationNames.insert(getConfigurationName(configuration)).second) {
+            throw runtime_error("Detector configuration " + getConfigurationTitle(configuration) + " is repeated");
+        }
+    }
+    return configurations;
+}
+
+// with a precision target or a time budget, the number of primaries / secondaries is only an upper limit
+void checkStatistics(int nEvents, int nSecondariesLimit) {
+    if ((nEvents == 0 && nSecondariesLimit == 0 && !AdaptiveStopping::IsEnabled()) ||
+        (nEvents > 0 && nSecondariesLimit > 0)) {
+        throw runtime_error("Either primaries or secondaries must be defined, but not both");
+    }
+}
+
+struct RunTotals {
+    chrono::duration<double> eventLoopTime{};
+    unsigned long long primaries = 0;
+    unsigned long long secondaries = 0;
+};
+
+// runs the configurations of the current job one after the other. Only the geometry is rebuilt between them, physics
+// tables and the input distributions are kept
+RunTotals runConfigurations(G4RunManager &runManager, DetectorConstruction &detector,
+                            const vector<DetectorConfiguration> &configurations, int nEventsToLaunch) {
+    RunTotals totals;
+    for (size_t i = 0; i < configurations.size(); i++) {
+        const auto &configuration = configurations[i];
+        if (detector.GetConfiguration() != configuration) {
+            detector.SetConfiguration(configuration);
+            runManager.ReinitializeGeometry(true);
+        }
+        if (configurations.size() > 1) {
+            cout << "Configuration " << i + 1 << " / " << configurations.size() << ": "
+                 << getConfigurationTitle(configuration) << endl;
+            RunAction::SetOutputDirectory(getConfigurationName(configuration), getConfigurationTitle(configuration));
+        } else {
+            RunAction::SetOutputDirectory("", getConfigurationTitle(configuration));
+        }
+        if (HitRecorder::IsEnabled()) {
+            HitRecorder::SetRun(i, getConfigurationTitle(configuration));
+        }
+
+        Metrics::Start(i);
+
+        cout << "nEvents: " << nEventsToLaunch << endl;
+        const auto timeRunStart = chrono::steady_clock::now();
+        if (nEventsToLaunch > 0) {
+            runManager.BeamOn(nEventsToLaunch);
         } else {
-            const auto count = RunAction::GetSecondariesCount();
-            cout << "Progress (secondaries): " << count << " / " << RunAction::GetRequestedSecondaries()
-                 << " (" << 100.0 * double(count) / RunAction::GetRequestedSecondaries() << "%)"
-                 << " Elapsed time: " << elapsed << " s" << endl;
+            runManager.BeamOn(numeric_limits<int>::max());
         }
 
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-    } while (checkCondition());
+        totals.eventLoopTime += chrono::steady_clock::now() - timeRunStart;
+        totals.primaries += RunAction::GetLaunchedPrimaries();
+        totals.secondaries += RunAction::GetSecondariesCount();
+
+        Metrics::Stop();
+    }
+    return totals;
+}
+
+// a job of the server ('--serve'): the per job subset of the command line options, parsed from the line of the job
+string runServerJob(const string &options, G4RunManager &runManager, DetectorConstruction &detector) {
+    int nEvents = 0;
+    int nSecondariesLimit = 0;
+    set<string> inputParticleNames = RunAction::GetInputParticlesAllowed();
+    string outputFilename;
+    DetectorConfiguration detectorConfiguration;
+    vector<string> scan;
+    string scanFilename;
+    long seed = 0;
+    double targetError = 0;
+    double targetSpeciesError = 0;
+    double maxTime = 0;
+
+    CLI::App app{"job"};
+    app.add_option("-n,--primaries", nEvents)->check(CLI::PositiveNumber);
+    app.add_option("-s,--secondaries", nSecondariesLimit)->check(CLI::PositiveNumber);
+    app.add_option("-p,--particle", inputParticleNames)->check(CLI::IsMember(RunAction::GetInputParticlesAllowed()));
+    app.add_option("-o,--output", outputFilename)->required();
+    app.add_option("-d,--detector", detectorConfiguration);
+    auto scanOption = app.add_option("--scan", scan)->expected(2);
+    app.add_option("--scan-file", scanFilename)->check(CLI::ExistingFile)->excludes(scanOption);
+    auto seedOption = app.add_option("--seed", seed)->check(CLI::PositiveNumber);
+    app.add_option("--target-error", targetError)->check(CLI::Range(0.0, 1.0));
+    app.add_option("--target-species-error", targetSpeciesError)->check(CLI::Range(0.0, 1.0));
+    app.add_option("--max-time", maxTime)->check(CLI::PositiveNumber);
+    app.parse(options);
+
+    AdaptiveStopping::Configure(targetError, targetSpeciesError, maxTime * 60);
+    checkStatistics(nEvents, nSecondariesLimit);
+    const auto configurations = getConfigurations(detectorConfiguration, scan, scanFilename);
+    if (seedOption->count() > 0) {
+        G4Random::setTheSeed(seed);
+    }
+
+    JobContext job;
+    job.inputParticleNames = inputParticleNames;
+    job.requestedPrimaries = nEvents;
+    job.requestedSecondaries = nSecondariesLimit;
+    job.outputFilename = outputFilename;
+    RunAction::BeginJob(std::move(job));
+
+    RunTotals totals;
+    try {
+        totals = runConfigurations(runManager, detector, configurations, nEvents);
+    } catch (...) {
+        RunAction::EndJob();
+        throw;
+    }
+    RunAction::EndJob();
+
+    ostringstream answer;
+    answer << "ok " << outputFilename << " " << totals.primaries << " primaries " << totals.secondaries
+           << " secondaries " << totals.eventLoopTime.count() << " s";
+    return answer.str();
 }
 
 int main(int argc, char **argv) {
@@ -54,77 +363,570 @@ int main(int argc, char **argv) {
     int nEvents = 0;
     int nSecondariesLimit = 0;
     int nThreads = 0;
+    string runManagerName;
+    int eventModulo = 0;
+    int grainsize = 0;
+    string seedsPer = "event";
     string inputFilename = "https://raw.githubusercontent.com/lobis/radiation-transmission/main/distributions/cry.root";
     string outputFilename;
     set<string> inputParticleNames = RunAction::GetInputParticlesAllowed();
-    vector<pair<string, double>> detectorConfiguration;
+    DetectorConfiguration detectorConfiguration;
+    vector<string> scan;
+    string scanFilename;
+    string checkpointFilename;
+    unsigned long long checkpointEveryEvents = 0;
+    double checkpointEverySeconds = 0;
+    string resumeFilename;
+    long seed = 0;
+    string shard;
+    string hitsFilename;
+    string timingFilename;
+    string metricsFilename;
+    string metricsFormat = "json";
+    double metricsInterval = 1;
+    double targetError = 0;
+    double targetSpeciesError = 0;
+    double maxTime = 0;
+    double importanceCellThickness = 0;
+    double importanceRatio = 2;
+    vector<string> rangeRejection;
+    string response;
+    string physics = "QGSP_BIC_HP_LIV";
+    optional<bool> radioactiveDecay;
+    optional<bool> emExtra;
+    string physicsCacheDirectory;
+    string scoring = "volume";
+    bool killOnExit = false;
+    bool albedo = false;
+    string composeDirectory;
+    bool composeCheck = false;
+    string serveSocket;
 
     CLI::App app{"radiation-transmission"};
 
     app.add_option("-n,--primaries", nEvents, "Number of primary particles to launch")->check(
             CLI::PositiveNumber);
-    app.add_option("-s,--secondaries", nSecondariesLimit, "Number of secondaries to limit the simulation to")->check(
+    app.add_option("-s,--secondaries", nSecondariesLimit,
+                   "Number of secondaries to limit the simulation to. Checked at the end of each event, the run stops with at least this many: the events in progress on the other threads are completed (see 'Secondaries limit' in the README)")->check(
+            CLI::PositiveNumber);
+    app.add_option("--target-error", targetError,
+                   "Stop once the relative error of the total flux reaching the detector is below this value (e.g. 0.01), '-n' / '-s' become optional upper limits")->check(
+            CLI::Range(0.0, 1.0));
+    app.add_option("--target-species-error", targetSpeciesError,
+                   "Stop once the relative error of the flux of every species reaching the detector is below this value")->check(
+            CLI::Range(0.0, 1.0));
+    app.add_option("--max-time", maxTime,
+                   "Stop the event loop of each run after this many minutes, '-n' / '-s' become optional upper limits")->check(
             CLI::PositiveNumber);
     app.add_option("-t,--threads", nThreads, "Number of threads. t=0 means no multithreading (default)")->check(
             CLI::NonNegativeNumber);
+    app.add_option("--run-manager", runManagerName,
+                   "Run manager: 'serial' (no threads), 'mt' (the master deals the events to the threads in batches of '--event-modulo') or 'tasking' (the events are split into tasks taken by the threads of a pool as they become free). Default: 'serial' without threads, 'mt' otherwise")->check(
+            CLI::IsMember({"serial", "mt", "tasking"}));
+    app.add_option("--event-modulo", eventModulo,
+                   "Number of events a thread takes at a time ('mt' and 'tasking'). Geant4 uses the square root of the events per thread by default; smaller batches keep all the threads busy until the end of runs whose events have very different costs")->check(
+            CLI::PositiveNumber);
+    app.add_option("--grainsize", grainsize,
+                   "Number of tasks the events of a run are split into ('tasking', default: the number of threads)")->check(
+            CLI::PositiveNumber);
+    app.add_option("--seeds-per", seedsPer,
+                   "How often the threads are reseeded by the master ('mt' and 'tasking'): every 'event' (reproducible whatever the number of threads), once per 'run' of each thread (reproducible with the same number of threads) or every batch of '--event-modulo' events")->check(
+            CLI::IsMember({"event", "run", "batch"}))->capture_default_str();
     app.add_option("-p,--particle", inputParticleNames, "Input particle type")->check(
             CLI::IsMember(RunAction::GetInputParticlesAllowed()));
     app.add_option("-i,--input", inputFilename,
-                   "Input root filename with particle energy / angle information")->required();
-    app.add_option("-o,--output", outputFilename, "Output root filename")->required();
+                   "Input root filename with particle energy / angle information, or input compiled with 'compile-input'");
+    app.add_option("-o,--output", outputFilename, "Output root filename");
     app.add_option("-d,--detector", detectorConfiguration,
-                   "Detector configuration: material and thickness (in mm) in the following format: '-d G4_Pb 100'. If called multiple times they will be stacked")->required();
+                   "Detector configuration: material and thickness (in mm) in the following format: '-d G4_Pb 100'. If called multiple times they will be stacked");
+    auto scanOption = app.add_option("--scan", scan,
+                                     "Scan the thickness of a layer stacked after the '-d' layers: '--scan G4_Pb 0:500:10' (start:stop:step in mm). Geant4 is initialised once and each configuration is written into its own directory of the output file")->expected(2);
+    app.add_option("--scan-file", scanFilename,
+                   "File with one detector configuration per line, in the same format as '-d' (e.g. 'G4_Pb 100 G4_WATER 10'). Geant4 is initialised once and each configuration is written into its own directory of the output file")->check(
+            CLI::ExistingFile)->excludes(scanOption);
+    auto checkpointEventsOption = app.add_option("--checkpoint-every-events", checkpointEveryEvents,
+                                                 "Write a checkpoint every this many primaries")->check(
+            CLI::PositiveNumber)->excludes(scanOption, "--scan-file");
+    auto checkpointSecondsOption = app.add_option("--checkpoint-every-seconds", checkpointEverySeconds,
+                                                  "Write a checkpoint every this many seconds")->check(
+            CLI::PositiveNumber)->excludes(scanOption, "--scan-file");
+    app.add_option("--checkpoint-file", checkpointFilename,
+                   "Checkpoint filename (default: output filename with '.checkpoint.root' appended)")->excludes(
+            scanOption, "--scan-file");
+    app.add_option("--resume", resumeFilename,
+                   "Resume from a checkpoint written by a previous run with the same detector configuration. The random engine state is not restored, the resumed run is statistically equivalent to an uninterrupted one but not identical")->check(
+            CLI::ExistingFile)->excludes(scanOption, "--scan-file");
+
+    auto seedOption = app.add_option("--seed", seed, "Seed of the random engine")->check(CLI::PositiveNumber);
+    app.add_option("--shard", shard,
+                   "Run only shard 'i/N' (0 <= i < N) of the simulation: the primaries / secondaries are split across the shards, each shard uses a seed derived from '--seed' and writes unnormalised results to be combined with 'radiation-transmission-merge'")->needs(
+            seedOption);
+
+    app.add_option("--hits", hitsFilename,
+                   "Also write every particle reaching the detector (energy, direction, position, time and primary) into a 'hits' tree of this root file, for offline analysis");
+
+    app.add_option("--metrics", metricsFilename,
+                   "Write live metrics of the event loop (events, hits per particle, steps, lock waits, throughput, per thread imbalance and ETA) to this file");
+    app.add_option("--metrics-format", metricsFormat,
+                   "Format of the metrics file: 'json' (one JSON object per line and sample) or 'prometheus' (text format, replaced at every sample)")->check(
+            CLI::IsMember({"json", "prometheus"}))->capture_default_str();
+    app.add_option("--metrics-interval", metricsInterval,
+                   "Interval between two samples of the metrics and of the progress printout (in s)")->check(
+            CLI::PositiveNumber)->capture_default_str();
+
+    app.add_option("--timing", timingFilename,
+                   "Write the initialisation and event loop times, and the number of primaries and secondaries, to this JSON file");
+
+    auto importanceOption = app.add_option("--importance-cell", importanceCellThickness,
+                                           "Enable importance biasing: the layers are split into cells of at most this thickness (in mm), particles are split when moving towards the detector and rouletted when moving away")->check(
+            CLI::PositiveNumber)->excludes(scanOption, "--scan-file");
+    app.add_option("--importance-ratio", importanceRatio,
+                   "Importance ratio between consecutive cells when importance biasing is enabled (default 2)")->check(
+            CLI::Range(1.0, 1000.0))->needs(importanceOption);
+
+    app.add_option("--physics", physics,
+                   "Physics preset: 'QGSP_BIC_HP_LIV' (accurate, default), 'FTFP_BERT' (fast) or 'EM' (electromagnetic only)")->check(
+            CLI::IsMember(PhysicsList::GetPresets()));
+    app.add_option("--radioactive-decay", radioactiveDecay,
+                   "Enable / disable radioactive decay, by default only enabled for 'QGSP_BIC_HP_LIV'");
+    app.add_option("--em-extra", emExtra,
+                   "Enable / disable extra EM physics (gamma and lepto nuclear), by default enabled except for 'EM'");
+    app.add_option("--physics-cache", physicsCacheDirectory,
+                   "Directory where the physics tables are stored after being built, and retrieved from by the following runs with the same Geant4 version, physics and materials")->excludes(
+            scanOption, "--scan-file");
+    app.add_option("--range-rejection", rangeRejection,
+                   "Kill the secondaries of this charged Geant4 particle ('GenericIon' for all ions) whose range is shorter than their distance to the detector. An optional relative safety margin on the range can be given as 'particle:margin' (default 0.1). Can be called multiple times. Killed e- and e+ no longer radiate bremsstrahlung or annihilate, which biases the gamma output low");
+
+    app.add_option("--scoring", scoring,
+                   "How the particles reaching the detector are scored: 'volume' (a thin sensitive volume after the last layer) or 'plane' (crossings of the exit surface of the last layer, without any extra volume)")->check(
+            CLI::IsMember({"volume", "plane"}))->excludes(importanceOption)->capture_default_str();
+    app.add_flag("--kill-on-exit", killOnExit,
+                 "Kill the particles as soon as they leave the stack through its front face or its sides, instead of transporting them through the vacuum of the world");
+    app.add_flag("--albedo", albedo,
+                 "Score the particles leaving the stack through its front face into the histograms of an 'albedo' directory, implies '--kill-on-exit'")->excludes(
+            checkpointEventsOption, checkpointSecondsOption, "--resume", "--shard");
+
+    app.add_option("--response", response,
+                   "Response-matrix mode: sample the primaries evenly over the (energy, zenith) bins of the input, with the energy uniform ('linear') or log-uniform ('log') within a bin, and write the transfer matrix of the detector, to be folded with any input spectrum by 'radiation-transmission-fold'")->check(
+            CLI::IsMember({"linear", "log"}))->excludes(checkpointEventsOption, checkpointSecondsOption, "--resume",
+                                                          "--shard", "--albedo");
+
+    auto composeOption = app.add_option("--compose", composeDirectory,
+                                        "Estimate the '-d' stack by chaining the transfer operators of its layers, cached in this directory. The layers not cached yet are simulated first with '-n' primaries each, sampled evenly over the input bins of all the species")->excludes(
+            scanOption, "--scan-file", checkpointEventsOption, checkpointSecondsOption, "--response", "--shard", "--resume", "--secondaries", "--target-error",
+            "--target-species-error", "--max-time", "--physics-cache", "--albedo");
+    app.add_flag("--compose-check", composeCheck,
+                 "Also simulate (or read from the cache) the operator of the whole stack, and compare it with the composed result")->needs(
+            composeOption);
+
+    app.add_option("--serve", serveSocket,
+                   "Server mode: initialise Geant4, the physics and the input samplers once, then run the jobs received on this Unix domain socket one after the other (see 'submit'). The '-d' layers, if any, are built at startup")->excludes(
+            scanOption, "--scan-file", checkpointEventsOption, checkpointSecondsOption, "--resume", "--shard",
+            "--response", "--compose", "--hits", "--timing", importanceOption, "--physics-cache");
+
+    string inputCacheDirectory = InputCache::GetDefaultDirectory();
+    bool offline = false;
+    app.add_option("--input-cache", inputCacheDirectory,
+                   "Directory where remote inputs are cached, keyed by url and content hash")->capture_default_str();
+    app.add_flag("--offline", offline, "Only use remote inputs already in the cache, never access the network");
+
+    string compileInputFilename;
+    string compileOutputFilename;
+    auto compileCommand = app.add_subcommand("compile-input",
+                                             "Compile an input root file into a binary file that is memory mapped by the simulation ('-i'), for a faster startup");
+    compileCommand->add_option("input", compileInputFilename, "Input root filename")->required();
+    compileCommand->add_option("output", compileOutputFilename, "Compiled input filename")->required();
+
+    vector<string> prefetchUrls = {inputFilename};
+    auto prefetchCommand = app.add_subcommand("prefetch",
+                                              "Download remote inputs into the input cache, so that the following runs do not access the network");
+    prefetchCommand->add_option("urls", prefetchUrls, "Urls of the inputs (default: the default input)");
+
+    string submitSocket;
+    auto submitCommand = app.add_subcommand("submit",
+                                            "Submit a job to a server started with '--serve' and wait for it to complete: 'submit SOCKET -n 100000 -p neutron -d G4_Pb 100 -o out.root' (-n, -s, -p, -o, -d, --scan, --scan-file, --seed, --target-error, --target-species-error and --max-time, paths relative to the working directory of the server)");
+    submitCommand->add_option("socket", submitSocket, "Socket of the server")->required();
+    submitCommand->prefix_command();
 
     // primaries or secondaries must be defined, but not both
 
     CLI11_PARSE(app, argc, argv)
 
-    if ((nEvents == 0 && nSecondariesLimit == 0) || (nEvents > 0 && nSecondariesLimit > 0)) {
-        throw runtime_error("Either primaries or secondaries must be defined, but not both");
+    if (*prefetchCommand) {
+        for (const auto &url: prefetchUrls) {
+            cout << url << " -> " << InputCache::Fetch(url, inputCacheDirectory) << endl;
+        }
+        return 0;
     }
 
-    RunAction::SetInputParticles(inputParticleNames);
-    RunAction::SetInputFilename(inputFilename);
-    RunAction::SetOutputFilename(outputFilename);
+    if (*compileCommand) {
+        compileInputFilename = InputCache::Resolve(compileInputFilename, inputCacheDirectory, offline);
+        CompiledInput::Compile(compileInputFilename, compileOutputFilename);
+        cout << "Compiled " << compileInputFilename << " into " << compileOutputFilename << endl;
+        return 0;
+    }
+
+    if (*submitCommand) {
+        string options;
+        for (const auto &argument: submitCommand->remaining()) {
+            const bool quote = argument.find_first_of(" \t") != string::npos;
+            options += (options.empty() ? "" : " ") + (quote ? "\"" + argument + "\"" : argument);
+        }
+        const auto answer = JobServer::Submit(submitSocket, options);
+        cout << answer << endl;
+        return answer.rfind("ok", 0) == 0 ? 0 : 1;
+    }
+
+    if (runManagerName.empty()) {
+        runManagerName = nThreads > 0 ? "mt" : "serial";
+    }
+    if ((runManagerName == "serial") != (nThreads == 0)) {
+        throw runtime_error("The 'serial' run manager runs without threads, 'mt' and 'tasking' need '-t'");
+    }
+    if (runManagerName == "serial" && (eventModulo > 0 || seedsPer != "event")) {
+        throw runtime_error("'--event-modulo' and '--seeds-per' need the 'mt' or 'tasking' run manager");
+    }
+    if (runManagerName != "tasking" && grainsize > 0) {
+        throw runtime_error("'--grainsize' needs the 'tasking' run manager");
+    }
+
+    // the statistics and the output of the server are given per job
+    const bool serving = !serveSocket.empty();
+
+    if (outputFilename.empty() && !serving) {
+        throw runtime_error("An output filename must be defined with '-o'");
+    }
+
+    AdaptiveStopping::Configure(targetError, targetSpeciesError, maxTime * 60);
 
-    RunAction::SetRequestedPrimaries(nEvents);
-    RunAction::SetRequestedSecondaries(nSecondariesLimit);
+    if (!serving) {
+        checkStatistics(nEvents, nSecondariesLimit);
+    }
+
+    unsigned int shardIndex = 0;
+    unsigned int shardsN = 0;
+    if (!shard.empty()) {
+        tie(shardIndex, shardsN) = parseShard(shard);
+        nEvents = getShardShare(nEvents, shardIndex, shardsN);
+        nSecondariesLimit = getShardShare(nSecondariesLimit, shardIndex, shardsN);
+        if (nEvents == 0 && nSecondariesLimit == 0 && !AdaptiveStopping::IsEnabled()) {
+            throw runtime_error("Shard " + shard + " has nothing to simulate");
+        }
+    }
+
+    // the server starts with the '-d' layers (possibly none), each job then brings its own configurations
+    auto configurations = serving ? vector<DetectorConfiguration>{detectorConfiguration}
+                                  : getConfigurations(detectorConfiguration, scan, scanFilename);
+
+    // histograms are filled concurrently by the worker threads, each thread owns its own detached copies
+    ROOT::EnableThreadSafety();
+    TH1::AddDirectory(false);
 
-    // check if file starts with "http" (first characters)
-    if (inputFilename.compare(0, 4, "http") == 0) {
-        // http file
-    } else if (!filesystem::exists(inputFilename)) {
+    // remote inputs are read from the local cache, only downloaded the first time
+    inputFilename = InputCache::Resolve(inputFilename, inputCacheDirectory, offline);
+    if (!filesystem::exists(inputFilename)) {
         cerr << "Input file " << inputFilename << " does not exist" << endl;
         return 1;
     }
 
-    const auto runManagerType = nThreads > 0 ? G4RunManagerType::MTOnly : G4RunManagerType::SerialOnly;
-    auto runManager = unique_ptr<G4RunManager>(G4RunManagerFactory::CreateRunManager(runManagerType));
+    // the layers whose transfer operator is not cached yet are simulated, then the stack is composed from the cache
+    LayerStack::Spectra composeInput;
+    string composeLatitude;
+    vector<filesystem::path> layerFilenames;
+    filesystem::path directFilename;
+    map<string, filesystem::path> layerFilenamesToStore;
+    string composeOutputFilename;
+    if (!composeDirectory.empty()) {
+        if (nEvents == 0) {
+            throw runtime_error("'--compose' requires the number of primaries per layer with '-n'");
+        }
+        composeInput = LayerStack::LoadSpectra(inputFilename, inputParticleNames, composeLatitude);
+
+        ostringstream settings;
+        settings << physics << " radioactive decay " << (radioactiveDecay ? to_string(*radioactiveDecay) : "default")
+                 << " em extra " << (emExtra ? to_string(*emExtra) : "default") << " importance "
+                 << importanceCellThickness << " " << importanceRatio << " primaries " << nEvents;
+        for (const auto &entry: rangeRejection) {
+            settings << " range rejection " << entry;
+        }
+        settings << "\n" << LayerStack::GetBinningDescription(composeInput);
+
+        vector<DetectorConfiguration> missingConfigurations;
+        const auto getCachedFilename = [&](const DetectorConfiguration &configuration) {
+            const auto filename = getLayerCacheFilename(composeDirectory, settings.str(), configuration);
+            if (!filesystem::exists(filename) &&
+                layerFilenamesToStore.emplace(getConfigurationName(configuration), filename).second) {
+                missingConfigurations.push_back(configuration);
+            }
+            return filename;
+        };
+        for (const auto &layer: detectorConfiguration) {
+            layerFilenames.push_back(getCachedFilename({layer}));
+        }
+        if (composeCheck) {
+            directFilename = getCachedFilename(detectorConfiguration);
+        }
+
+        if (missingConfigurations.empty()) {
+            composeStack(composeInput, layerFilenames, directFilename, composeLatitude,
+                         getConfigurationTitle(detectorConfiguration), outputFilename);
+            cout << "Total runtime: "
+                 << chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - timeStart).count() << " s"
+                 << endl;
+            return 0;
+        }
+
+        cout << "Simulating the transfer operators of " << missingConfigurations.size()
+             << " configurations not cached in " << composeDirectory << endl;
+        // every family is an incoming species of the next layer, whatever the species of the input
+        inputParticleNames = RunAction::GetInputParticlesAllowed();
+        ResponseMatrix::Enable(ResponseMatrix::Sampling::linear, ResponseMatrix::Grid::transfer);
+        configurations = missingConfigurations;
+        composeOutputFilename = outputFilename;
+        outputFilename += ".layers.root";
+    }
+
+    RunAction::SetInputFilename(inputFilename);
+
+    if (checkpointEventsOption->count() > 0 || checkpointSecondsOption->count() > 0) {
+        if (checkpointFilename.empty()) {
+            checkpointFilename = outputFilename + ".checkpoint.root";
+        }
+        Checkpoint::Configure(checkpointFilename, checkpointEveryEvents, checkpointEverySeconds);
+    }
+    Checkpoint::SetDescription(getConfigurationTitle(configurations.front()));
+    int nEventsToLaunch = nEvents;
+    if (!resumeFilename.empty()) {
+        Checkpoint::Resume(resumeFilename);
+        const auto resumeState = Checkpoint::GetResumeState();
+        unsigned long long resumed = 0;
+        for (const auto particle: inputParticlesAll) {
+            resumed += resumeState->launchedPrimaries[ToIndex(particle)];
+        }
+        cout << "Resuming from " << resumeFilename << ": " << resumed << " primaries, " << resumeState->secondaries
+             << " secondaries" << endl;
+        if ((nEvents > 0 && resumed >= (unsigned long long) nEvents) ||
+            (nSecondariesLimit > 0 && resumeState->secondaries >= (unsigned long long) nSecondariesLimit)) {
+            throw runtime_error("Checkpoint " + resumeFilename + " already contains the requested statistics");
+        }
+        // the requested number of primaries includes the ones of the checkpoint
+        nEventsToLaunch = nEvents > 0 ? nEvents - (int) resumed : 0;
+    }
+
+    if (!response.empty()) {
+        ResponseMatrix::Enable(response == "log" ? ResponseMatrix::Sampling::log : ResponseMatrix::Sampling::linear);
+    }
+
+    if (!rangeRejection.empty()) {
+        map<string, double> margins;
+        for (const auto &entry: rangeRejection) {
+            const auto separator = entry.find(':');
+            const auto margin = separator == string::npos ? 0.1 : stod(entry.substr(separator + 1));
+            if (margin < 0) {
+                throw runtime_error("Invalid range rejection margin in '" + entry + "'");
+            }
+            margins[entry.substr(0, separator)] = margin;
+        }
+        StackingAction::SetRangeRejection(margins);
+    }
+
+    // the albedo is scored where the particles leave the stack
+    SteppingAction::SetKillOnExit(killOnExit || albedo);
+    RunAction::SetAlbedo(albedo);
+
+    if (!hitsFilename.empty()) {
+        HitRecorder::Open(hitsFilename);
+    }
+
+    Metrics::Configure(metricsFilename, metricsFormat == "prometheus" ? Metrics::Format::prometheus : Metrics::Format::json,
+                       metricsInterval);
+
+    if (importanceCellThickness > 0) {
+        // weighted histograms, so that the uncertainties are computed from the sum of the squared weights
+        TH1::SetDefaultSumw2(true);
+    }
+
+    // must outlive the run manager, which owns the physics constructors using them
+    vector<unique_ptr<G4GeometrySampler>> importanceSamplers;
+
+    const map<string, G4RunManagerType> runManagerTypes = {
+            {"serial",  G4RunManagerType::SerialOnly},
+            {"mt",      G4RunManagerType::MTOnly},
+            {"tasking", G4RunManagerType::TaskingOnly},
+    };
+    auto runManager = unique_ptr<G4RunManager>(G4RunManagerFactory::CreateRunManager(runManagerTypes.at(runManagerName)));
 
     if (nThreads > 0) {
         runManager->SetNumberOfThreads((G4int) nThreads);
     }
+    // the tasking run manager is also a G4MTRunManager
+    if (const auto mtRunManager = dynamic_cast<G4MTRunManager *>(runManager.get())) {
+        if (eventModulo > 0) {
+            mtRunManager->SetEventModulo(eventModulo);
+        }
+        const map<string, G4int> seedsPerCommunication = {{"event", 0}, {"run", 1}, {"batch", 2}};
+        G4MTRunManager::SetSeedOncePerCommunication(seedsPerCommunication.at(seedsPer));
+    }
+    if (const auto taskRunManager = dynamic_cast<G4TaskRunManager *>(runManager.get())) {
+        if (grainsize > 0) {
+            taskRunManager->SetGrainsize(grainsize);
+        }
+    }
 
-    runManager->SetUserInitialization(new DetectorConstruction(detectorConfiguration));
-    runManager->SetUserInitialization(new PhysicsList);
+    auto detector = new DetectorConstruction(configurations.front());
+    detector->SetScoringPlane(scoring == "plane");
+    runManager->SetUserInitialization(detector);
+    auto physicsList = new PhysicsList(physics, radioactiveDecay, emExtra);
+    runManager->SetUserInitialization(physicsList);
+    cout << "Physics: " << physicsList->GetDescription() << endl;
+    RunAction::SetPhysicsDescription(physicsList->GetDescription());
 
     runManager->SetUserInitialization(new ActionInitialization);
 
+    if (importanceCellThickness > 0) {
+        detector->SetImportanceBiasing(importanceCellThickness, importanceRatio);
+        // the samplers need the world volume, the geometry is built before the physics
+        runManager->InitializeGeometry();
+        for (const auto particleName: {"neutron", "gamma", "e-", "e+", "mu-", "mu+", "proton"}) {
+            auto sampler = make_unique<G4GeometrySampler>(detector->GetWorld(), particleName);
+            sampler->SetParallel(false);
+            physicsList->RegisterPhysics(new G4ImportanceBiasing(sampler.get()));
+            importanceSamplers.push_back(std::move(sampler));
+        }
+    }
+
+    filesystem::path physicsTablesDirectory;
+    bool physicsTablesRetrieved = false;
+    if (!physicsCacheDirectory.empty()) {
+        physicsTablesDirectory = getPhysicsCacheDirectory(physicsCacheDirectory, physicsList->GetDescription(),
+                                                          configurations.front());
+        physicsTablesRetrieved = filesystem::exists(physicsTablesDirectory);
+        if (physicsTablesRetrieved) {
+            physicsList->SetPhysicsTableRetrieved(physicsTablesDirectory.string());
+        }
+    }
+
     runManager->Initialize();
+    // builds the physics tables now rather than at the start of the first run, so that they count as initialisation
+    runManager->BeamOn(0);
 
-    std::thread t(printProgress);
-    t.detach();
+    if (!physicsTablesDirectory.empty() && !physicsTablesRetrieved) {
+        // stored next to the final directory and renamed, concurrent jobs never retrieve an incomplete set of tables
+        const auto temporaryDirectory = physicsTablesDirectory.string() + ".tmp." + to_string(getpid());
+        filesystem::create_directories(temporaryDirectory);
+        if (physicsList->StorePhysicsTable(temporaryDirectory)) {
+            error_code error;
+            filesystem::rename(temporaryDirectory, physicsTablesDirectory, error);
+        }
+        filesystem::remove_all(temporaryDirectory);
+    }
 
-    cout << "nEvents: " << nEvents << endl;
-    if (nEvents > 0) {
-        runManager->BeamOn(nEvents);
+    // the input and the samplers are otherwise only built at the start of the first run, they are part of the
+    // initialisation; the server builds the ones of every species, before the first job arrives
+    RunAction::BuildSamplers(serving ? RunAction::GetInputParticlesAllowed() : inputParticleNames);
+
+    const auto timeInitialization = chrono::steady_clock::now();
+    cout << "Initialisation time: " << chrono::duration<double>(timeInitialization - timeStart).count() << " s";
+    if (!physicsTablesDirectory.empty()) {
+        cout << " (physics tables " << (physicsTablesRetrieved ? "retrieved from " : "stored in ")
+             << physicsTablesDirectory.string() << ")";
+    }
+    cout << endl;
+    // a resumed run must not repeat the random sequence of the previous segments
+    if (Checkpoint::GetResumeState() != nullptr) {
+        const auto seed = Checkpoint::GetResumeRandomSeed();
+        const auto segment = Checkpoint::GetResumeSegment() + 1;
+        G4Random::setTheSeed(DeriveSeed(seed, segment));
+        Checkpoint::SetRandomSeed(seed, segment);
     } else {
-        runManager->BeamOn(numeric_limits<int>::max());
+        if (seedOption->count() > 0) {
+            // shards of the same run are statistically independent
+            G4Random::setTheSeed(shardsN > 0 ? DeriveSeed(seed, shardIndex) : seed);
+        }
+        Checkpoint::SetRandomSeed(G4Random::getTheSeed(), 0);
+    }
+
+    if (serving) {
+        JobServer server(serveSocket);
+        cout << "Serving jobs on " << serveSocket << endl;
+        while (const auto job = server.Next()) {
+            cout << "Job: " << job->options << endl;
+            string answer;
+            try {
+                answer = runServerJob(job->options, *runManager, *detector);
+            } catch (const exception &error) {
+                answer = string("error ") + error.what();
+            }
+            cout << answer << endl;
+            JobServer::Reply(*job, answer);
+        }
+        cout << "Total runtime: "
+             << chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - timeStart).count() << " s" << endl;
+        return 0;
+    }
+
+    JobContext job;
+    job.inputParticleNames = inputParticleNames;
+    job.requestedPrimaries = nEvents;
+    job.requestedSecondaries = nSecondariesLimit;
+    job.outputFilename = outputFilename;
+    job.shardIndex = shardIndex;
+    job.shardsN = shardsN;
+    job.shardRandomSeed = seed;
+    RunAction::BeginJob(std::move(job));
+
+    const auto [eventLoopTime, totalPrimaries, totalSecondaries] = runConfigurations(*runManager, *detector,
+                                                                                     configurations, nEventsToLaunch);
+
+    RunAction::EndJob();
+    HitRecorder::Close();
+
+    if (!composeDirectory.empty()) {
+        // the operators of the simulated configurations are cached, the stack is then composed as if they had all been
+        // found in the cache
+        {
+            const auto layersFile = unique_ptr<TFile>(TFile::Open(outputFilename.c_str(), "READ"));
+            for (const auto &configuration: configurations) {
+                TDirectory *directory = layersFile.get();
+                if (configurations.size() > 1) {
+                    directory = layersFile->GetDirectory(getConfigurationName(configuration).c_str());
+                }
+                LayerStack::Store(directory, layerFilenamesToStore.at(getConfigurationName(configuration)).string());
+            }
+            layersFile->Close();
+        }
+        filesystem::remove(outputFilename);
+        composeStack(composeInput, layerFilenames, directFilename, composeLatitude,
+                     getConfigurationTitle(detectorConfiguration), composeOutputFilename);
     }
 
     const auto elapsed = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - timeStart).count();
 
     cout << "Total runtime: " << elapsed << " s" << endl;
 
+    if (!timingFilename.empty()) {
+        const chrono::duration<double> initializationTime = timeInitialization - timeStart;
+        ofstream timing(timingFilename);
+        timing << "{\n"
+               << "  \"geant4_version\": \"" << G4Version << "\",\n"
+               << "  \"physics\": \"" << physicsList->GetDescription() << "\",\n"
+               << "  \"scoring\": \"" << scoring << "\",\n"
+               << "  \"physics_tables_retrieved\": " << (physicsTablesRetrieved ? "true" : "false") << ",\n"
+               << "  \"threads\": " << nThreads << ",\n"
+               << "  \"run_manager\": \"" << runManagerName << "\",\n"
+               << "  \"event_modulo\": " << eventModulo << ",\n"
+               << "  \"initialization_s\": " << initializationTime.count() << ",\n"
+               << "  \"event_loop_s\": " << eventLoopTime.count() << ",\n"
+               << "  \"primaries\": " << totalPrimaries << ",\n"
+               << "  \"secondaries\": " << totalSecondaries << ",\n"
+               << "  \"tail_idle_s\": [";
+        const auto tailIdle = Metrics::GetTailIdle();
+        for (size_t i = 0; i < tailIdle.size(); i++) {
+            timing << (i > 0 ? ", " : "") << tailIdle[i];
+        }
+        timing << "]\n"
+               << "}" << endl;
+    }
+
     return 0;
 }
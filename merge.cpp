@@ -0,0 +1,154 @@
+#include "InputParticle.h"
+#include "RawResults.h"
+
+#include "CLI/CLI.hpp"
+
+#include <TFile.h>
+#include <TH1.h>
+#include <TKey.h>
+#include <TNamed.h>
+#include <TParameter.h>
+
+#include <iostream>
+#include <memory>
+#include <set>
+
+using namespace std;
+
+long long getParameter(TDirectory *directory, const string &key) {
+    const auto parameter = unique_ptr<TParameter<Long64_t>>(directory->Get<TParameter<Long64_t>>(key.c_str()));
+    if (!parameter) {
+        throw runtime_error(key + " not found in " + directory->GetName() + ", not a shard written with '--shard'");
+    }
+    return parameter->GetVal();
+}
+
+string getDetector(TDirectory *directory) {
+    const auto detector = unique_ptr<TNamed>(directory->Get<TNamed>("detector"));
+    return detector ? detector->GetTitle() : "";
+}
+
+// directories holding results: the top level for a single configuration, one directory per configuration for scans
+vector<string> getResultsDirectories(TFile *file) {
+    if (RawResults::IsStoredIn(file)) {
+        return {""};
+    }
+    vector<string> directories;
+    for (const auto object: *file->GetListOfKeys()) {
+        const auto key = (TKey *) object;
+        if (string(key->GetClassName()) != "TDirectoryFile") {
+            continue;
+        }
+        if (RawResults::IsStoredIn(file->GetDirectory(key->GetName()))) {
+            directories.emplace_back(key->GetName());
+        }
+    }
+    return directories;
+}
+
+int main(int argc, char **argv) {
+    vector<string> inputFilenames;
+    string outputFilename;
+
+    CLI::App app{"radiation-transmission-merge"};
+
+    app.add_option("-o,--output", outputFilename, "Output root filename")->required();
+    app.add_option("shards", inputFilenames, "Shard root files written with '--shard'")->required()->check(
+            CLI::ExistingFile);
+
+    CLI11_PARSE(app, argc, argv)
+
+    TH1::AddDirectory(false);
+
+    vector<unique_ptr<TFile>> inputFiles;
+    for (const auto &filename: inputFilenames) {
+        inputFiles.emplace_back(TFile::Open(filename.c_str(), "READ"));
+        if (!inputFiles.back() || inputFiles.back()->IsZombie()) {
+            throw runtime_error("Could not open " + filename);
+        }
+    }
+
+    // all the shards must belong to the same run and each one must be merged only once
+    const auto &first = inputFiles.front();
+    const auto seed = getParameter(first.get(), "random_seed");
+    const auto shardsN = getParameter(first.get(), "shards");
+    set<long long> shards;
+    for (const auto &file: inputFiles) {
+        if (getParameter(file.get(), "random_seed") != seed || getParameter(file.get(), "shards") != shardsN) {
+            throw runtime_error(string(file->GetName()) + " belongs to a different run than " + first->GetName());
+        }
+        if (!shards.insert(getParameter(file.get(), "shard")).second) {
+            throw runtime_error("Shard " + to_string(getParameter(file.get(), "shard")) + " is repeated");
+        }
+    }
+    if ((long long) shards.size() != shardsN) {
+        cerr << "Warning: merging " << shards.size() << " out of " << shardsN
+             << " shards, the results are normalised to the primaries of the merged shards only" << endl;
+    }
+
+    const auto directories = getResultsDirectories(first.get());
+    if (directories.empty()) {
+        throw runtime_error(string("No results found in ") + first->GetName());
+    }
+
+    auto outputFile = unique_ptr<TFile>(TFile::Open(outputFilename.c_str(), "RECREATE"));
+    if (!outputFile || outputFile->IsZombie()) {
+        throw runtime_error("Could not create " + outputFilename);
+    }
+
+    for (const auto &directoryName: directories) {
+        auto getDirectory = [&directoryName](const unique_ptr<TFile> &file) -> TDirectory * {
+            const auto directory = directoryName.empty() ? file.get() : file->GetDirectory(directoryName.c_str());
+            if (directory == nullptr) {
+                throw runtime_error("Directory " + directoryName + " not found in " + file->GetName());
+            }
+            return directory;
+        };
+
+        const auto detector = getDetector(getDirectory(first));
+        RawResults results;
+        for (const auto &file: inputFiles) {
+            if (getDetector(getDirectory(file)) != detector) {
+                throw runtime_error(string(file->GetName()) + " was simulated with a different detector than " +
+                                    first->GetName());
+            }
+            results.AddFromDirectory(getDirectory(file));
+        }
+
+        // normalisation is only applied once, to the total of all the shards
+        for (const auto particle: inputParticlesAll) {
+            const auto name = "input_" + GetInputParticleName(particle);
+            const auto inputEnergyZenith = unique_ptr<TH2D>(first->Get<TH2D>((name + "_energy_zenith").c_str()));
+            const auto inputEnergy = unique_ptr<TH1D>(first->Get<TH1D>((name + "_energy").c_str()));
+            const auto inputZenith = unique_ptr<TH1D>(first->Get<TH1D>((name + "_zenith").c_str()));
+            if (!inputEnergyZenith || !inputEnergy || !inputZenith) {
+                throw runtime_error("Input distributions " + name + "_* not found in " + first->GetName());
+            }
+            results.Normalize(particle, *inputEnergyZenith, *inputEnergy, *inputZenith);
+        }
+
+        cout << (directoryName.empty() ? detector : directoryName) << ": " << results.GetLaunchedPrimaries()
+             << " primaries, " << results.secondaries << " secondaries, flux (counts / s / m2): "
+             << results.histograms->GetIntegral() << endl;
+
+        TDirectory *directory = outputFile.get();
+        if (!directoryName.empty()) {
+            directory = outputFile->mkdir(directoryName.c_str(), getDirectory(first)->GetTitle());
+        }
+        results.histograms->Write(directory);
+    }
+
+    // input information, identical in all the shards
+    outputFile->cd();
+    for (const auto object: *first->GetListOfKeys()) {
+        const auto key = (TKey *) object;
+        const string name = key->GetName();
+        if (name == "latitude" || name == "physics" || name.compare(0, 6, "input_") == 0) {
+            unique_ptr<TObject>(key->ReadObj())->Write();
+        }
+    }
+
+    outputFile->Close();
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include "EventAction.h"
 #include "PrimaryGeneratorAction.h"
 #include "RunAction.h"
+#include "StackingAction.h"
 #include "SteppingAction.h"
 #include "TrackingAction.h"
 
@@ -23,4 +24,7 @@ void ActionInitialization::Build() const {
     SetUserAction(new EventAction);
     SetUserAction(new SteppingAction);
     SetUserAction(new TrackingAction);
+    if (StackingAction::IsRangeRejectionEnabled()) {
+        SetUserAction(new StackingAction);
+    }
 }
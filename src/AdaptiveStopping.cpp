@@ -0,0 +1,199 @@
+
+#include "AdaptiveStopping.h"
+
+#include <TNamed.h>
+#include <TParameter.h>
+
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+double AdaptiveStopping::totalError = 0;
+double AdaptiveStopping::speciesError = 0;
+double AdaptiveStopping::maxSeconds = 0;
+
+chrono::steady_clock::time_point AdaptiveStopping::start;
+atomic<chrono::steady_clock::rep> AdaptiveStopping::nextCheck = 0;
+atomic<bool> AdaptiveStopping::stopRequested = false;
+string AdaptiveStopping::stopReason;
+
+mutex AdaptiveStopping::talliesMutex;
+vector<unique_ptr<AdaptiveStopping::ThreadTallies>> AdaptiveStopping::tallies = {};
+G4ThreadLocal AdaptiveStopping::ThreadTallies *AdaptiveStopping::threadTallies = nullptr;
+G4ThreadLocal array<double, AdaptiveStopping::talliesN> AdaptiveStopping::threadEventSums = {};
+
+void AdaptiveStopping::Configure(double newTotalError, double newSpeciesError, double newMaxSeconds) {
+    totalError = newTotalError;
+    speciesError = newSpeciesError;
+    maxSeconds = newMaxSeconds;
+}
+
+bool AdaptiveStopping::IsEnabled() {
+    return totalError > 0 || speciesError > 0 || maxSeconds > 0;
+}
+
+void AdaptiveStopping::Start() {
+    {
+        // the threads of a previous run are idle, their tallies start again from zero
+        lock_guard<mutex> lock(talliesMutex);
+        for (auto &threadTallies: tallies) {
+            threadTallies->events = 0;
+            for (size_t i = 0; i < talliesN; i++) {
+                threadTallies->sums[i] = 0;
+                threadTallies->sumsSquared[i] = 0;
+            }
+        }
+        stopReason = "run completed";
+    }
+
+    start = chrono::steady_clock::now();
+    nextCheck = (start + checkInterval).time_since_epoch().count();
+    stopRequested = false;
+}
+
+AdaptiveStopping::ThreadTallies &AdaptiveStopping::RegisterThread() {
+    lock_guard<mutex> lock(talliesMutex);
+    tallies.push_back(make_unique<ThreadTallies>());
+    threadTallies = tallies.back().get();
+    return *threadTallies;
+}
+
+bool AdaptiveStopping::EndOfEvent() {
+    auto &threadTallies = AdaptiveStopping::threadTallies != nullptr ? *AdaptiveStopping::threadTallies
+                                                                      : RegisterThread();
+
+    // single writer per slot, the evaluating thread may read a slightly outdated but consistent enough state
+    threadTallies.events.store(threadTallies.events.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    for (size_t i = 0; i < talliesN; i++) {
+        const auto sum = threadEventSums[i];
+        if (sum == 0) {
+            continue;
+        }
+        threadTallies.sums[i].store(threadTallies.sums[i].load(memory_order_relaxed) + sum, memory_order_relaxed);
+        threadTallies.sumsSquared[i].store(threadTallies.sumsSquared[i].load(memory_order_relaxed) + sum * sum,
+                                           memory_order_relaxed);
+    }
+    threadEventSums.fill(0);
+
+    if (!IsEnabled()) {
+        return false; // the tallies are still kept, the achieved precision is always written
+    }
+    if (stopRequested.load(memory_order_relaxed)) {
+        return true;
+    }
+
+    // a single thread evaluates the criteria per interval, the others carry on
+    const auto now = chrono::steady_clock::now().time_since_epoch().count();
+    auto check = nextCheck.load(memory_order_relaxed);
+    if (now >= check && nextCheck.compare_exchange_strong(
+            check, now + chrono::duration_cast<chrono::steady_clock::duration>(checkInterval).count())) {
+        Evaluate();
+    }
+
+    return stopRequested.load(memory_order_relaxed);
+}
+
+AdaptiveStopping::Precision AdaptiveStopping::GetPrecision() {
+    Precision precision;
+    array<double, talliesN> sums = {};
+    array<double, talliesN> sumsSquared = {};
+    for (const auto &threadTallies: tallies) {
+        precision.events += threadTallies->events.load(memory_order_relaxed);
+        for (size_t i = 0; i < talliesN; i++) {
+            sums[i] += threadTallies->sums[i].load(memory_order_relaxed);
+            sumsSquared[i] += threadTallies->sumsSquared[i].load(memory_order_relaxed);
+        }
+    }
+
+    // relative error of the mean score per history
+    const double n = double(precision.events);
+    for (size_t i = 0; i < talliesN; i++) {
+        if (sums[i] <= 0 || precision.events < 2) {
+            precision.relativeErrors[i] = -1;
+            continue;
+        }
+        const double mean = sums[i] / n;
+        const double variance = max(sumsSquared[i] / n - mean * mean, 0.0) * n / (n - 1);
+        precision.relativeErrors[i] = sqrt(variance / n) / mean;
+    }
+    return precision;
+}
+
+void AdaptiveStopping::Evaluate() {
+    lock_guard<mutex> lock(talliesMutex);
+
+    ostringstream reason;
+    if (maxSeconds > 0 && chrono::duration<double>(chrono::steady_clock::now() - start).count() >= maxSeconds) {
+        reason << "time budget of " << maxSeconds << " s";
+    } else {
+        const auto precision = GetPrecision();
+        if (precision.events < minimumEvents) {
+            return;
+        }
+
+        const auto &errors = precision.relativeErrors;
+        if (totalError > 0 && (errors[0] < 0 || errors[0] > totalError)) {
+            return;
+        }
+        // the species with the largest error, the one the per species criterion is decided by
+        size_t worstSpecies = 0;
+        if (speciesError > 0) {
+            // only the species seen so far can be judged, a species not reaching the detector never blocks the stop
+            for (size_t i = 1; i < talliesN; i++) {
+                if (errors[i] < 0) {
+                    continue;
+                }
+                if (errors[i] > speciesError) {
+                    return;
+                }
+                if (worstSpecies == 0 || errors[i] > errors[worstSpecies]) {
+                    worstSpecies = i;
+                }
+            }
+            if (worstSpecies == 0) {
+                return;
+            }
+        }
+        if (totalError <= 0 && speciesError <= 0) {
+            return;
+        }
+
+        // every enabled criterion is met, all of them are named
+        if (totalError > 0) {
+            reason << "relative error of the total flux " << errors[0] << " <= " << totalError;
+        }
+        if (speciesError > 0) {
+            reason << (totalError > 0 ? ", " : "") << "relative error of every species <= " << speciesError
+                   << " (largest " << errors[worstSpecies] << " for " << GetTallyName(worstSpecies) << ")";
+        }
+        reason << " after " << precision.events << " events";
+    }
+
+    stopReason = reason.str();
+    stopRequested = true;
+    cout << "Stopping the run: " << stopReason << endl;
+}
+
+string AdaptiveStopping::GetTallyName(size_t tally) {
+    return tally == 0 ? "total" : GetInputParticleName(inputParticlesAll[tally - 1]);
+}
+
+void AdaptiveStopping::Write(TDirectory *directory) {
+    lock_guard<mutex> lock(talliesMutex);
+    const auto precision = GetPrecision();
+
+    cout << "Relative error of the flux after " << precision.events << " events:" << endl;
+    directory->cd();
+    for (size_t i = 0; i < talliesN; i++) {
+        const auto name = GetTallyName(i);
+        const auto error = precision.relativeErrors[i];
+        if (error >= 0) {
+            cout << "    - " << name << ": " << error << endl;
+        }
+        // -1 when the species never reached the detector
+        TParameter<double>(("relative_error_" + name).c_str(), error).Write();
+    }
+    TNamed("stop_reason", stopReason.c_str()).Write();
+}
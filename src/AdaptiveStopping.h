@@ -0,0 +1,81 @@
+
+#pragma once
+
+#include <G4Threading.hh>
+
+#include <TDirectory.h>
+
+#include "InputParticle.h"
+#include "OutputHistograms.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Stops the run once the flux reaching the detector is known to a target relative error, or once a wall time budget is
+// spent. Each event is one history: the weights of its hits are summed per species and the sums and sums of squares are
+// kept per thread, so the relative error of the flux is estimated without ever merging the histograms. The criteria are
+// evaluated at event boundaries, at most every 'checkInterval', and every thread then stops softly at the end of its
+// current event so the normalisation covers only complete events
+class AdaptiveStopping {
+public:
+    // 0 disables a criterion. 'speciesError' applies to every species that reached the detector at least once
+    static void Configure(double totalError, double speciesError, double maxSeconds);
+
+    static bool IsEnabled();
+
+    static void Start(); // master, before the event loop
+
+    static void AddHit(OutputParticle particle, double weight) {
+        threadEventSums[0] += weight;
+        threadEventSums[1 + ToIndex(GetOutputParticleFamily(particle))] += weight;
+    }
+
+    // accounts the event of this thread, true when the run must stop
+    static bool EndOfEvent();
+
+    // relative errors and stop reason of the run, written next to the results
+    static void Write(TDirectory *directory);
+
+private:
+    static constexpr std::size_t talliesN = 1 + inputParticlesN; // total flux, then one per species
+    static constexpr unsigned long long minimumEvents = 1000; // errors of fewer histories are not trusted
+    static constexpr std::chrono::milliseconds checkInterval{500};
+
+    struct alignas(64) ThreadTallies {
+        std::atomic<unsigned long long> events = 0;
+        std::array<std::atomic<double>, talliesN> sums = {};
+        std::array<std::atomic<double>, talliesN> sumsSquared = {};
+    };
+
+    struct Precision {
+        unsigned long long events = 0;
+        std::array<double, talliesN> relativeErrors = {}; // negative when there is no hit to estimate it from
+    };
+
+    static ThreadTallies &RegisterThread();
+
+    static Precision GetPrecision();
+
+    static void Evaluate();
+
+    static std::string GetTallyName(std::size_t tally);
+
+    static double totalError;
+    static double speciesError;
+    static double maxSeconds;
+
+    static std::chrono::steady_clock::time_point start;
+    static std::atomic<std::chrono::steady_clock::rep> nextCheck;
+    static std::atomic<bool> stopRequested;
+    static std::string stopReason; // written by the thread requesting the stop, read after the run
+
+    static std::mutex talliesMutex; // only taken when a thread registers and when evaluating
+    static std::vector<std::unique_ptr<ThreadTallies>> tallies;
+    static G4ThreadLocal ThreadTallies *threadTallies;
+    static G4ThreadLocal std::array<double, talliesN> threadEventSums;
+};
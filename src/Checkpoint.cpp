@@ -0,0 +1,235 @@
+
+#include "Checkpoint.h"
+#include "Metrics.h"
+#include "RunAction.h"
+
+#include <TFile.h>
+#include <TNamed.h>
+#include <TParameter.h>
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+
+using namespace std;
+
+string Checkpoint::filename;
+unsigned long long Checkpoint::everyEvents = 0;
+double Checkpoint::everySeconds = 0;
+string Checkpoint::description;
+long Checkpoint::randomSeed = 0;
+unsigned int Checkpoint::segment = 0;
+
+unique_ptr<RawResults> Checkpoint::resumeState = nullptr;
+long Checkpoint::resumeRandomSeed = 0;
+unsigned int Checkpoint::resumeSegment = 0;
+
+atomic<unsigned long long> Checkpoint::generation = 0;
+mutex Checkpoint::snapshotsMutex;
+vector<unique_ptr<Checkpoint::ThreadSnapshot>> Checkpoint::snapshots = {};
+G4ThreadLocal Checkpoint::ThreadSnapshot *Checkpoint::threadSnapshot = nullptr;
+
+thread Checkpoint::writer;
+mutex Checkpoint::writerMutex;
+condition_variable Checkpoint::writerCondition;
+bool Checkpoint::writerStop = false;
+
+void Checkpoint::Configure(const string &name, unsigned long long events, double seconds) {
+    filename = name;
+    everyEvents = events;
+    everySeconds = seconds;
+}
+
+bool Checkpoint::IsEnabled() {
+    return !filename.empty() && (everyEvents > 0 || everySeconds > 0);
+}
+
+void Checkpoint::SetDescription(const string &newDescription) {
+    description = newDescription;
+}
+
+void Checkpoint::SetRandomSeed(long seed, unsigned int newSegment) {
+    randomSeed = seed;
+    segment = newSegment;
+}
+
+void Checkpoint::Resume(const string &name) {
+    auto file = unique_ptr<TFile>(TFile::Open(name.c_str(), "READ"));
+    if (!file || file->IsZombie()) {
+        throw runtime_error("Checkpoint::Resume: could not open checkpoint file " + name);
+    }
+
+    const auto detector = unique_ptr<TNamed>(file->Get<TNamed>("detector"));
+    if (!detector || detector->GetTitle() != description) {
+        throw runtime_error("Checkpoint::Resume: checkpoint " + name + " was written for a different detector (" +
+                            (detector ? detector->GetTitle() : "unknown") + ")");
+    }
+
+    resumeState = make_unique<RawResults>();
+    resumeState->AddFromDirectory(file.get());
+
+    const auto seed = unique_ptr<TParameter<Long64_t>>(file->Get<TParameter<Long64_t>>("random_seed"));
+    const auto previousSegment = unique_ptr<TParameter<Long64_t>>(file->Get<TParameter<Long64_t>>("segment"));
+    if (!seed || !previousSegment) {
+        throw runtime_error("Checkpoint::Resume: random seed not found in checkpoint " + name);
+    }
+    resumeRandomSeed = seed->GetVal();
+    resumeSegment = previousSegment->GetVal();
+
+    file->Close();
+}
+
+const RawResults *Checkpoint::GetResumeState() {
+    return resumeState.get();
+}
+
+long Checkpoint::GetResumeRandomSeed() {
+    return resumeRandomSeed;
+}
+
+unsigned int Checkpoint::GetResumeSegment() {
+    return resumeSegment;
+}
+
+void Checkpoint::Start() {
+    {
+        // snapshots of a previous run are discarded, the threads keep their slots
+        lock_guard<mutex> lock(snapshotsMutex);
+        for (auto &snapshot: snapshots) {
+            lock_guard<mutex> lockSnapshot(snapshot->mutex);
+            snapshot->state = RawResults();
+            snapshot->generation = 0;
+        }
+    }
+    generation = 0;
+
+    writerStop = false;
+    writer = thread(WriterLoop);
+}
+
+void Checkpoint::Stop() {
+    if (!writer.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(writerMutex);
+        writerStop = true;
+    }
+    writerCondition.notify_all();
+    writer.join();
+}
+
+bool Checkpoint::IsSnapshotRequested() {
+    const auto requested = generation.load(memory_order_relaxed);
+    if (requested == 0) {
+        return false;
+    }
+    return threadSnapshot == nullptr || threadSnapshot->generation.load(memory_order_relaxed) != requested;
+}
+
+void Checkpoint::Snapshot(const OutputHistograms &histograms,
+                          const array<unsigned long long, inputParticlesN> &launchedPrimaries,
+                          unsigned long long secondaries) {
+    if (threadSnapshot == nullptr) {
+        lock_guard<mutex> lock(snapshotsMutex);
+        snapshots.push_back(make_unique<ThreadSnapshot>());
+        threadSnapshot = snapshots.back().get();
+    }
+
+    const auto requested = generation.load();
+    {
+        // only contended while the writer merges this thread's previous snapshot
+        const auto lock = Metrics::Lock(threadSnapshot->mutex);
+        threadSnapshot->state.histograms->Reset();
+        threadSnapshot->state.histograms->Add(histograms);
+        threadSnapshot->state.launchedPrimaries = launchedPrimaries;
+        threadSnapshot->state.secondaries = secondaries;
+    }
+    threadSnapshot->generation = requested;
+}
+
+void Checkpoint::WriterLoop() {
+    using clock = chrono::steady_clock;
+
+    auto lastTime = clock::now();
+    auto lastEvents = RunAction::GetLaunchedPrimaries();
+
+    unique_lock<mutex> lock(writerMutex);
+    while (!writerStop) {
+        writerCondition.wait_for(lock, chrono::milliseconds(100));
+        if (writerStop) {
+            break;
+        }
+
+        const auto events = RunAction::GetLaunchedPrimaries();
+        const bool due = (everySeconds > 0 && clock::now() - lastTime >= chrono::duration<double>(everySeconds)) ||
+                         (everyEvents > 0 && events - lastEvents >= everyEvents);
+        if (!due) {
+            continue;
+        }
+
+        // request a snapshot and give the threads some time to finish their current event. Threads stuck in a long
+        // event contribute their previous snapshot, which is still consistent
+        const auto requested = ++generation;
+        const auto deadline = clock::now() + chrono::seconds(5);
+        while (!writerStop && clock::now() < deadline) {
+            bool complete = true;
+            {
+                lock_guard<mutex> lockSnapshots(snapshotsMutex);
+                for (const auto &snapshot: snapshots) {
+                    complete &= snapshot->generation == requested;
+                }
+            }
+            if (complete && !snapshots.empty()) {
+                break;
+            }
+            writerCondition.wait_for(lock, chrono::milliseconds(10));
+        }
+        if (writerStop) {
+            break;
+        }
+
+        lock.unlock();
+        try {
+            WriteCheckpoint();
+        } catch (const exception &error) {
+            cerr << "Checkpoint: could not write checkpoint " << filename << ": " << error.what() << endl;
+        }
+        lock.lock();
+
+        lastTime = clock::now();
+        lastEvents = events;
+    }
+}
+
+void Checkpoint::WriteCheckpoint() {
+    RawResults merged;
+    if (resumeState) {
+        merged.Add(*resumeState);
+    }
+    {
+        lock_guard<mutex> lock(snapshotsMutex);
+        for (const auto &snapshot: snapshots) {
+            lock_guard<mutex> lockSnapshot(snapshot->mutex);
+            merged.Add(snapshot->state);
+        }
+    }
+
+    // written next to the final file and renamed, a crash while writing never leaves a corrupted checkpoint
+    const auto temporaryFilename = filename + ".tmp";
+    auto file = unique_ptr<TFile>(TFile::Open(temporaryFilename.c_str(), "RECREATE"));
+    if (!file || file->IsZombie()) {
+        throw runtime_error("could not create " + temporaryFilename);
+    }
+
+    merged.Write(file.get());
+    TParameter<Long64_t>("random_seed", randomSeed).Write();
+    TParameter<Long64_t>("segment", segment).Write();
+    TNamed("detector", description.c_str()).Write();
+
+    file->Close();
+    filesystem::rename(temporaryFilename, filename);
+
+    cout << "Checkpoint written to " << filename << " (" << merged.GetLaunchedPrimaries() << " primaries, " << merged.secondaries
+         << " secondaries)" << endl;
+}
@@ -0,0 +1,87 @@
+
+#pragma once
+
+#include <G4Threading.hh>
+
+#include "InputParticle.h"
+#include "OutputHistograms.h"
+#include "RawResults.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Periodic checkpoints of the unnormalised results, written to a side file by a background thread.
+// When a checkpoint is due, each thread copies its own results at the end of its current event. The writer merges the
+// latest copy of every thread (each one is consistent on its own) and replaces the checkpoint file atomically, so the
+// event loop never waits for the file to be written
+class Checkpoint {
+public:
+    // a checkpoint is written every 'everyEvents' primaries and / or every 'everySeconds' seconds (0 to disable)
+    static void Configure(const std::string &filename, unsigned long long everyEvents, double everySeconds);
+
+    static bool IsEnabled();
+
+    // detector configuration, stored in the checkpoint and checked when resuming
+    static void SetDescription(const std::string &description);
+
+    // seed of the first run segment and index of the current segment, each resumed segment uses a derived seed
+    static void SetRandomSeed(long seed, unsigned int segment);
+
+    // loads the results of a previous run, they are added to the results of the next runs
+    static void Resume(const std::string &filename);
+
+    static const RawResults *GetResumeState(); // nullptr when not resuming
+
+    static long GetResumeRandomSeed();
+
+    static unsigned int GetResumeSegment();
+
+    static void Start(); // master, before the event loop
+
+    static void Stop(); // master, after the event loop
+
+    // cheap check done by every thread at the end of each event
+    static bool IsSnapshotRequested();
+
+    static void Snapshot(const OutputHistograms &histograms,
+                         const std::array<unsigned long long, inputParticlesN> &launchedPrimaries,
+                         unsigned long long secondaries);
+
+private:
+    struct ThreadSnapshot {
+        std::mutex mutex;
+        RawResults state;
+        std::atomic<unsigned long long> generation = 0;
+    };
+
+    static void WriterLoop();
+
+    static void WriteCheckpoint();
+
+    static std::string filename;
+    static unsigned long long everyEvents;
+    static double everySeconds;
+    static std::string description;
+    static long randomSeed;
+    static unsigned int segment;
+
+    static std::unique_ptr<RawResults> resumeState;
+    static long resumeRandomSeed;
+    static unsigned int resumeSegment;
+
+    static std::atomic<unsigned long long> generation; // incremented by the writer to request a snapshot
+    static std::mutex snapshotsMutex;
+    static std::vector<std::unique_ptr<ThreadSnapshot>> snapshots;
+    static G4ThreadLocal ThreadSnapshot *threadSnapshot;
+
+    static std::thread writer;
+    static std::mutex writerMutex;
+    static std::condition_variable writerCondition;
+    static bool writerStop;
+};
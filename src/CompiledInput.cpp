@@ -0,0 +1,278 @@
+#include "CompiledInput.h"
+
+#include <TFile.h>
+#include <TNamed.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+constexpr char signature[8] = {'R', 'T', 'I', 'N', 'P', 'U', 'T', '\0'};
+
+void AppendString(vector<char> &strings, const string &value) {
+    const auto length = (uint32_t) value.size();
+    strings.insert(strings.end(), (const char *) &length, (const char *) &length + sizeof(length));
+    strings.insert(strings.end(), value.begin(), value.end());
+}
+
+void AppendAxis(vector<double> &tables, const TAxis &axis) {
+    for (int i = 1; i <= axis.GetNbins() + 1; ++i) {
+        tables.push_back(axis.GetBinLowEdge(i));
+    }
+}
+} // namespace
+
+void CompiledInput::Compile(const string &inputFilename, const string &outputFilename) {
+    auto input = unique_ptr<TFile>(TFile::Open(inputFilename.c_str(), "READ"));
+    if (!input || input->IsZombie()) {
+        throw runtime_error("CompiledInput::Compile: could not open " + inputFilename);
+    }
+
+    Header header{};
+    memcpy(header.magic, signature, sizeof(signature));
+    header.version = formatVersion;
+    header.byteOrder = byteOrderMarker;
+    header.speciesN = inputParticlesN;
+
+    vector<double> tables;
+    vector<char> strings;
+
+    const auto latitudeNamed = unique_ptr<TNamed>(input->Get<TNamed>("latitude"));
+    AppendString(strings, latitudeNamed ? latitudeNamed->GetTitle() : "");
+
+    for (const auto particle: inputParticlesAll) {
+        const auto name = GetInputParticleName(particle);
+        const auto energyZenith = unique_ptr<TH2D>(input->Get<TH2D>((name + "_energy_zenith").c_str()));
+        const auto energy = unique_ptr<TH1D>(input->Get<TH1D>((name + "_energy").c_str()));
+        const auto zenith = unique_ptr<TH1D>(input->Get<TH1D>((name + "_zenith").c_str()));
+
+        auto &species = header.species[ToIndex(particle)];
+        if (!energyZenith || !energy || !zenith) {
+            for (int i = 0; i < 3; i++) {
+                AppendString(strings, "");
+            }
+            continue;
+        }
+
+        const EnergyZenithSampler sampler(*energyZenith);
+        species.present = 1;
+        species.binsEnergyN = energyZenith->GetXaxis()->GetNbins();
+        species.binsZenithN = energyZenith->GetYaxis()->GetNbins();
+        species.binsEnergy1DN = energy->GetNbinsX();
+        species.binsZenith1DN = zenith->GetNbinsX();
+        species.entries = energyZenith->GetEntries();
+        species.integral = energyZenith->Integral();
+        species.offset = sizeof(Header) + tables.size() * sizeof(double);
+
+        tables.insert(tables.end(), sampler.GetEnergyEdges().begin(), sampler.GetEnergyEdges().end());
+        tables.insert(tables.end(), sampler.GetZenithEdges().begin(), sampler.GetZenithEdges().end());
+        tables.insert(tables.end(), sampler.GetCumulative().begin(), sampler.GetCumulative().end());
+        for (const auto hist: {energy.get(), zenith.get()}) {
+            AppendAxis(tables, *hist->GetXaxis());
+            for (int i = 1; i <= hist->GetNbinsX(); ++i) {
+                tables.push_back(hist->GetBinContent(i));
+            }
+        }
+
+        AppendString(strings, energyZenith->GetTitle());
+        AppendString(strings, energy->GetTitle());
+        AppendString(strings, zenith->GetTitle());
+    }
+
+    header.stringsOffset = sizeof(Header) + tables.size() * sizeof(double);
+    header.size = header.stringsOffset + strings.size();
+
+    // written next to the final file and renamed, concurrent jobs never map a partially written file
+    const auto temporaryFilename = outputFilename + ".tmp." + to_string(getpid());
+    {
+        ofstream output(temporaryFilename, ios::binary);
+        output.write((const char *) &header, sizeof(header));
+        output.write((const char *) tables.data(), (streamsize) (tables.size() * sizeof(double)));
+        output.write(strings.data(), (streamsize) strings.size());
+        if (!output) {
+            throw runtime_error("CompiledInput::Compile: could not write " + temporaryFilename);
+        }
+    }
+    if (rename(temporaryFilename.c_str(), outputFilename.c_str()) != 0) {
+        throw runtime_error("CompiledInput::Compile: could not write " + outputFilename);
+    }
+}
+
+bool CompiledInput::IsCompiled(const string &filename) {
+    ifstream file(filename, ios::binary);
+    char magic[sizeof(signature)] = {};
+    return file.read(magic, sizeof(magic)) && memcmp(magic, signature, sizeof(signature)) == 0;
+}
+
+CompiledInput::CompiledInput(const string &filename) {
+    const int descriptor = open(filename.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+        throw runtime_error("CompiledInput: could not open " + filename);
+    }
+    struct stat status{};
+    fstat(descriptor, &status);
+    size = status.st_size;
+    void *mapping = size >= sizeof(Header) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    if (mapping == MAP_FAILED) {
+        throw runtime_error("CompiledInput: could not map " + filename);
+    }
+    data = (const std::byte *) mapping;
+
+    try {
+        Validate(filename);
+    } catch (...) {
+        munmap((void *) data, size);
+        throw;
+    }
+}
+
+void CompiledInput::Validate(const string &filename) {
+    const auto &header = *(const Header *) data;
+    if (memcmp(header.magic, signature, sizeof(signature)) == 0 && header.byteOrder == __builtin_bswap32(byteOrderMarker)) {
+        throw runtime_error("CompiledInput: " + filename +
+                            " was compiled on a machine of the other byte order, compile it again");
+    }
+    if (memcmp(header.magic, signature, sizeof(signature)) != 0 || header.version != formatVersion ||
+        header.byteOrder != byteOrderMarker || header.speciesN != inputParticlesN || header.size != size) {
+        throw runtime_error("CompiledInput: " + filename + " is not a compiled input of version " +
+                            to_string(formatVersion) + ", compile it again");
+    }
+
+    // every table and string must lie within the mapping, a corrupt file is never read out of bounds
+    const auto corrupt = [&filename](const string &reason) {
+        return runtime_error("CompiledInput: " + filename + " is corrupt (" + reason + "), compile it again");
+    };
+    if (header.stringsOffset < sizeof(Header) || header.stringsOffset > size) {
+        throw corrupt("strings offset");
+    }
+    for (const auto particle: inputParticlesAll) {
+        const auto &species = header.species[ToIndex(particle)];
+        if (species.present == 0) {
+            continue;
+        }
+        if (species.binsEnergyN == 0 || species.binsZenithN == 0 || species.binsEnergy1DN == 0 ||
+            species.binsZenith1DN == 0 || (uint64_t) species.binsEnergyN * species.binsZenithN > size ||
+            species.binsEnergy1DN > size || species.binsZenith1DN > size) {
+            // no table can hold more doubles than the file has bytes, GetTablesSize cannot overflow
+            throw corrupt(GetInputParticleName(particle) + " binning");
+        }
+        if (species.offset < sizeof(Header) || species.offset % alignof(double) != 0 ||
+            species.offset > header.stringsOffset ||
+            GetTablesSize(species) > header.stringsOffset - species.offset) {
+            throw corrupt(GetInputParticleName(particle) + " tables");
+        }
+    }
+
+    auto strings = (const char *) data + header.stringsOffset;
+    const auto stringsEnd = (const char *) data + size;
+    auto readString = [&]() {
+        uint32_t length;
+        if (stringsEnd - strings < (ptrdiff_t) sizeof(length)) {
+            throw corrupt("strings");
+        }
+        memcpy(&length, strings, sizeof(length));
+        strings += sizeof(length);
+        if (stringsEnd - strings < (ptrdiff_t) length) {
+            throw corrupt("strings");
+        }
+        string value(strings, length);
+        strings += length;
+        return value;
+    };
+    latitude = readString();
+    for (auto &speciesTitles: titles) {
+        for (auto &title: speciesTitles) {
+            title = readString();
+        }
+    }
+}
+
+uint64_t CompiledInput::GetTablesSize(const SpeciesHeader &species) {
+    // energy and zenith edges, cumulative distribution, edges and contents of the two 1D distributions
+    const uint64_t doublesN = (uint64_t) species.binsEnergyN + 1 + (uint64_t) species.binsZenithN + 1 +
+                              (uint64_t) species.binsEnergyN * species.binsZenithN +
+                              2 * (uint64_t) species.binsEnergy1DN + 1 + 2 * (uint64_t) species.binsZenith1DN + 1;
+    return doublesN * sizeof(double);
+}
+
+CompiledInput::~CompiledInput() {
+    munmap((void *) data, size);
+}
+
+const CompiledInput::SpeciesHeader &CompiledInput::GetSpecies(InputParticle particle) const {
+    return ((const Header *) data)->species[ToIndex(particle)];
+}
+
+const double *CompiledInput::GetTables(InputParticle particle) const {
+    if (!HasParticle(particle)) {
+        throw runtime_error("CompiledInput: no input distribution for " + GetInputParticleName(particle));
+    }
+    return (const double *) (data + GetSpecies(particle).offset);
+}
+
+bool CompiledInput::HasParticle(InputParticle particle) const {
+    return GetSpecies(particle).present != 0;
+}
+
+double CompiledInput::GetEntries(InputParticle particle) const {
+    return GetSpecies(particle).entries;
+}
+
+unique_ptr<EnergyZenithSampler> CompiledInput::MakeSampler(InputParticle particle) const {
+    const auto &species = GetSpecies(particle);
+    const auto tables = GetTables(particle);
+    const span<const double> energyEdges(tables, species.binsEnergyN + 1);
+    const span<const double> zenithEdges(energyEdges.data() + energyEdges.size(), species.binsZenithN + 1);
+    const span<const double> cumulative(zenithEdges.data() + zenithEdges.size(),
+                                        (size_t) species.binsEnergyN * species.binsZenithN);
+    return make_unique<EnergyZenithSampler>(energyEdges, zenithEdges, cumulative);
+}
+
+tuple<TH2D *, TH1D *, TH1D *> CompiledInput::MakeHistograms(InputParticle particle) const {
+    const auto &species = GetSpecies(particle);
+    const auto name = "input_" + GetInputParticleName(particle);
+    const auto &[energyZenithTitle, energyTitle, zenithTitle] = titles[ToIndex(particle)];
+
+    auto table = GetTables(particle);
+    const auto energyEdges = table;
+    const auto zenithEdges = energyEdges + species.binsEnergyN + 1;
+    const auto cumulative = zenithEdges + species.binsZenithN + 1;
+
+    auto energyZenith = new TH2D((name + "_energy_zenith").c_str(), energyZenithTitle.c_str(),
+                                 (int) species.binsEnergyN, energyEdges, (int) species.binsZenithN, zenithEdges);
+    double previous = 0;
+    for (unsigned int j = 0; j < species.binsZenithN; ++j) {
+        for (unsigned int i = 0; i < species.binsEnergyN; ++i) {
+            const auto value = cumulative[j * species.binsEnergyN + i];
+            energyZenith->SetBinContent((int) i + 1, (int) j + 1, (value - previous) * species.integral);
+            previous = value;
+        }
+    }
+    energyZenith->SetEntries(species.entries);
+
+    table = cumulative + (size_t) species.binsEnergyN * species.binsZenithN;
+    auto makeHist = [&table](const string &histName, const string &title, unsigned int binsN) {
+        auto hist = new TH1D(histName.c_str(), title.c_str(), (int) binsN, table);
+        table += binsN + 1;
+        for (unsigned int i = 0; i < binsN; ++i) {
+            hist->SetBinContent((int) i + 1, table[i]);
+        }
+        table += binsN;
+        return hist;
+    };
+    const auto energy = makeHist(name + "_energy", energyTitle, species.binsEnergy1DN);
+    const auto zenith = makeHist(name + "_zenith", zenithTitle, species.binsZenith1DN);
+
+    return {energyZenith, energy, zenith};
+}
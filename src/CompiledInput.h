@@ -0,0 +1,93 @@
+#pragma once
+
+#include <TH1D.h>
+#include <TH2D.h>
+
+#include "EnergyZenithSampler.h"
+#include "InputParticle.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+
+// Input distributions compiled into a flat, versioned binary file ('radiation-transmission compile-input').
+// The file is memory mapped read-only: the samplers read their tables directly from the mapping, so startup does not
+// depend on ROOT I/O and all the processes of a node share the same page cache pages
+class CompiledInput {
+public:
+    explicit CompiledInput(const std::string &filename);
+
+    ~CompiledInput();
+
+    CompiledInput(const CompiledInput &) = delete;
+
+    CompiledInput &operator=(const CompiledInput &) = delete;
+
+    static void Compile(const std::string &inputFilename, const std::string &outputFilename);
+
+    // checks the file signature, false for remote or ROOT files
+    static bool IsCompiled(const std::string &filename);
+
+    bool HasParticle(InputParticle particle) const;
+
+    double GetEntries(InputParticle particle) const;
+
+    // the sampler reads the tables of the mapping, which must outlive it
+    std::unique_ptr<EnergyZenithSampler> MakeSampler(InputParticle particle) const;
+
+    // rebuilt input histograms, named as in the output file ('input_neutron_energy_zenith', ...). Owned by the caller
+    std::tuple<TH2D *, TH1D *, TH1D *> MakeHistograms(InputParticle particle) const;
+
+    const std::string &GetLatitude() const { return latitude; }
+
+private:
+    static constexpr std::uint32_t formatVersion = 2;
+
+    // written in the native layout, a file compiled on a machine of the other byte order reads it swapped
+    static constexpr std::uint32_t byteOrderMarker = 0x01020304;
+
+    // tables of each species, in doubles: energy edges, zenith edges, cumulative distribution (energy index running
+    // fastest), then edges and contents of the 1D energy and zenith distributions
+    struct SpeciesHeader {
+        std::uint32_t present;
+        std::uint32_t binsEnergyN;
+        std::uint32_t binsZenithN;
+        std::uint32_t binsEnergy1DN;
+        std::uint32_t binsZenith1DN;
+        std::uint32_t padding;
+        double entries;
+        double integral; // of the energy / zenith distribution
+        std::uint64_t offset; // of the tables, in bytes from the start of the file
+    };
+
+    // followed by the tables, then the strings (size and characters): latitude, then the titles of the three
+    // histograms of each species
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byteOrder;
+        std::uint32_t speciesN;
+        std::uint32_t padding;
+        std::uint64_t stringsOffset;
+        std::uint64_t size;
+        std::array<SpeciesHeader, inputParticlesN> species;
+    };
+
+    // size in bytes of the tables of a species
+    static std::uint64_t GetTablesSize(const SpeciesHeader &species);
+
+    const SpeciesHeader &GetSpecies(InputParticle particle) const;
+
+    // header, tables and strings within the mapping, reads the strings
+    void Validate(const std::string &filename);
+
+    const double *GetTables(InputParticle particle) const;
+
+    const std::byte *data = nullptr;
+    std::size_t size = 0;
+
+    std::string latitude;
+    std::array<std::array<std::string, 3>, inputParticlesN> titles;
+};
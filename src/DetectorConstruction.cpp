@@ -2,10 +2,12 @@
 #include "DetectorConstruction.h"
 #include "SensitiveDetector.h"
 
+#include <G4IStore.hh>
 #include <G4LogicalVolumeStore.hh>
 #include <G4NistManager.hh>
 #include <G4PhysicalVolumeStore.hh>
 
+#include <cmath>
 #include <random>
 #include <G4PVPlacement.hh>
 
@@ -39,6 +41,10 @@ G4VPhysicalVolume *DetectorConstruction::Construct() {
     auto worldLogical = new G4LogicalVolume(worldSolid, vacuum, "World");
     world = new G4PVPlacement(nullptr, {}, worldLogical, "World", nullptr, false, 0);
 
+    layers.clear();
+    importanceCells.clear();
+    double importance = 1;
+
     double totalThickness = 0;
     for (int i = 0; i < configuration.size(); i++) {
         const auto &config = configuration[i];
@@ -49,17 +55,49 @@ G4VPhysicalVolume *DetectorConstruction::Construct() {
             cout << "Warning: Layer " << i << " has zero thickness, skipping it" << endl;
             continue;
         }
-        auto solid = new G4Box("Layer" + to_string(i), width / 2, width / 2, thickness / 2);
-        auto logical = new G4LogicalVolume(solid, material, "Layer" + to_string(i));
-        new G4PVPlacement(nullptr, {0, 0, totalThickness + thickness / 2}, logical, "Layer" + to_string(i),
-                          worldLogical, false, 0);
-        totalThickness += thickness;
+        layers.push_back({totalThickness, totalThickness + thickness, material});
+        if (!IsImportanceBiasingEnabled()) {
+            auto solid = new G4Box("Layer" + to_string(i), width / 2, width / 2, thickness / 2);
+            auto logical = new G4LogicalVolume(solid, material, "Layer" + to_string(i));
+            new G4PVPlacement(nullptr, {0, 0, totalThickness + thickness / 2}, logical, "Layer" + to_string(i),
+                              worldLogical, false, 0);
+            totalThickness += thickness;
+            continue;
+        }
+
+        // importance cells, each one a placement of the same slab
+        const auto cellsN = (int) ceil(thickness / (importanceCellThickness * mm) - 1E-9);
+        const auto cellThickness = thickness / cellsN;
+        const auto name = "Layer" + to_string(i) + "Cell";
+        auto solid = new G4Box(name, width / 2, width / 2, cellThickness / 2);
+        auto logical = new G4LogicalVolume(solid, material, name);
+        for (int j = 0; j < cellsN; j++) {
+            const auto cell = new G4PVPlacement(nullptr, {0, 0, totalThickness + cellThickness / 2}, logical,
+                                                name + to_string(j), worldLogical, false, j);
+            importanceCells.emplace_back(cell, importance);
+            importance *= importanceRatio;
+            totalThickness += cellThickness;
+        }
+        cout << "Layer " << i << " is split into " << cellsN << " importance cells" << endl;
+    }
+
+    detectorPosition = totalThickness;
+
+    if (IsScoringPlane()) {
+        // no sensitive volume, the crossings of the exit surface are scored by the stepping action
+        if (world->CheckOverlaps(1000, 0, true)) {
+            throw runtime_error("Overlaps found in geometry");
+        }
+        return world;
     }
 
     auto detectorSolid = new G4Box("Detector", width / 2, width / 2, detectorThickness / 2);
     auto detectorLogical = new G4LogicalVolume(detectorSolid, vacuum, "Detector");
-    new G4PVPlacement(nullptr, {0, 0, totalThickness + detectorThickness / 2}, detectorLogical, "Detector",
-                      worldLogical, false, 0);
+    const auto detector = new G4PVPlacement(nullptr, {0, 0, totalThickness + detectorThickness / 2}, detectorLogical,
+                                            "Detector", worldLogical, false, 0);
+    // the particles reaching the detector are scored, they must be neither rouletted nor split on the way in: same
+    // importance as the last cell (1 if no layer is split)
+    importanceCells.emplace_back(detector, importanceCells.empty() ? 1.0 : importanceCells.back().second);
 
     // check for overlaps (not sure if this actually works)
     if (world->CheckOverlaps(1000, 0, true)) {
@@ -70,9 +108,29 @@ G4VPhysicalVolume *DetectorConstruction::Construct() {
 }
 
 void DetectorConstruction::ConstructSDandField() {
-    auto detectorLogical = G4LogicalVolumeStore::GetInstance()->GetVolume("Detector");
-    auto detector = new SensitiveDetector("Detector");
-    SetSensitiveDetector(detectorLogical, detector);
+    // called again on every thread each time the geometry is rebuilt, the sensitive detector is reused
+    static G4ThreadLocal SensitiveDetector *detector = nullptr;
+    if (detector == nullptr) {
+        detector = new SensitiveDetector("Detector");
+    }
+
+    if (!IsScoringPlane()) {
+        auto detectorLogical = G4LogicalVolumeStore::GetInstance()->GetVolume("Detector");
+        SetSensitiveDetector(detectorLogical, detector);
+    }
+
+    // the importance store is thread local, each thread processing events fills its own
+    if (IsImportanceBiasingEnabled()) {
+        CreateImportanceStore();
+    }
 }
 
 
+
+void DetectorConstruction::CreateImportanceStore() const {
+    auto store = G4IStore::GetInstance();
+    store->AddImportanceGeometryCell(1, *world);
+    for (const auto &[cell, importance]: importanceCells) {
+        store->AddImportanceGeometryCell(importance, *cell, cell->GetCopyNo());
+    }
+}
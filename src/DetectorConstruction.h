@@ -14,6 +14,13 @@
 class DetectorConstruction : public G4VUserDetectorConstruction {
 
 public:
+    // slab of the stack, along z
+    struct Layer {
+        double start;
+        double end;
+        const G4Material *material;
+    };
+
     DetectorConstruction(const std::vector<std::pair<std::string, double>> &configuration);
 
     G4VPhysicalVolume *Construct() override;
@@ -24,11 +31,51 @@ public:
 
     void ConstructSDandField() override;
 
+    // takes effect the next time the geometry is built, e.g. after G4RunManager::ReinitializeGeometry
+    void SetConfiguration(const std::vector<std::pair<std::string, double>> &newConfiguration) {
+        configuration = newConfiguration;
+    }
+
+    const std::vector<std::pair<std::string, double>> &GetConfiguration() const { return configuration; }
+
+    // splits the layers into cells of at most 'cellThickness' (mm) whose importance grows by 'ratio' from one cell to
+    // the next towards the detector. Takes effect the next time the geometry is built
+    void SetImportanceBiasing(double cellThickness, double ratio) {
+        importanceCellThickness = cellThickness;
+        importanceRatio = ratio;
+    }
+
+    bool IsImportanceBiasingEnabled() const { return importanceCellThickness > 0; }
+
+    // scores the particles crossing the exit surface of the last layer in the stepping action instead of with a thin
+    // sensitive volume after it. Takes effect the next time the geometry is built
+    void SetScoringPlane(bool enabled) { scoringPlane = enabled; }
+
+    // an empty stack has no exit surface, the sensitive volume is kept for it
+    bool IsScoringPlane() const { return scoringPlane && !layers.empty(); }
+
+    // layers of the current geometry in stacking order, zero thickness layers excluded
+    const std::vector<Layer> &GetLayers() const { return layers; }
+
+    // z of the detector plane, right after the last layer
+    double GetDetectorPosition() const { return detectorPosition; }
 
 private:
+    // fills the importance store of the calling thread with the cells of the current geometry
+    void CreateImportanceStore() const;
+
     G4VPhysicalVolume *world = nullptr;
 
-    const std::vector<std::pair<std::string, double>> configuration;
+    std::vector<Layer> layers;
+    double detectorPosition = 0;
+
+    bool scoringPlane = false;
+
+    double importanceCellThickness = 0;
+    double importanceRatio = 2;
+    std::vector<std::pair<G4VPhysicalVolume *, double>> importanceCells; // cells with their importance, world excluded
+
+    std::vector<std::pair<std::string, double>> configuration;
 };
 
 
@@ -0,0 +1,67 @@
+#include "EnergyZenithSampler.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+EnergyZenithSampler::EnergyZenithSampler(const TH2D &hist) {
+    const auto energyAxis = hist.GetXaxis();
+    const auto zenithAxis = hist.GetYaxis();
+    const int binsEnergyN = energyAxis->GetNbins();
+    const int binsZenithN = zenithAxis->GetNbins();
+
+    storage.reserve((binsEnergyN + 1) + (binsZenithN + 1) + binsEnergyN * binsZenithN);
+
+    for (int i = 1; i <= binsEnergyN + 1; ++i) {
+        storage.push_back(energyAxis->GetBinLowEdge(i));
+    }
+    for (int j = 1; j <= binsZenithN + 1; ++j) {
+        storage.push_back(zenithAxis->GetBinLowEdge(j));
+    }
+
+    // flattened with the energy index running fastest, underflow and overflow bins are ignored (as in GetRandom2)
+    const auto cumulativeBegin = storage.size();
+    double sum = 0;
+    for (int j = 1; j <= binsZenithN; ++j) {
+        for (int i = 1; i <= binsEnergyN; ++i) {
+            sum += max(0.0, hist.GetBinContent(i, j));
+            storage.push_back(sum);
+        }
+    }
+    if (sum <= 0) {
+        throw runtime_error("EnergyZenithSampler: histogram " + string(hist.GetName()) + " is empty");
+    }
+    for (auto value = storage.begin() + (long) cumulativeBegin; value != storage.end(); ++value) {
+        *value /= sum;
+    }
+    storage.back() = 1.0;
+
+    const span<const double> all = storage;
+    energyEdges = all.subspan(0, binsEnergyN + 1);
+    zenithEdges = all.subspan(binsEnergyN + 1, binsZenithN + 1);
+    cumulative = all.subspan(cumulativeBegin);
+}
+
+EnergyZenithSampler::EnergyZenithSampler(span<const double> energyEdges, span<const double> zenithEdges,
+                                         span<const double> cumulative)
+        : energyEdges(energyEdges), zenithEdges(zenithEdges), cumulative(cumulative) {
+    if (energyEdges.size() < 2 || zenithEdges.size() < 2 ||
+        cumulative.size() != (energyEdges.size() - 1) * (zenithEdges.size() - 1)) {
+        throw runtime_error("EnergyZenithSampler: inconsistent sampling tables");
+    }
+}
+
+pair<double, double> EnergyZenithSampler::Sample(double randomBin, double randomEnergy, double randomZenith) const {
+    const auto bin = min<size_t>(upper_bound(cumulative.begin(), cumulative.end(), randomBin) - cumulative.begin(),
+                                 cumulative.size() - 1);
+    const auto binsEnergyN = energyEdges.size() - 1;
+    const auto i = bin % binsEnergyN;
+    const auto j = bin / binsEnergyN;
+
+    const double energy = energyEdges[i] + randomEnergy * (energyEdges[i + 1] - energyEdges[i]);
+    const double zenith = zenithEdges[j] + randomZenith * (zenithEdges[j + 1] - zenithEdges[j]);
+
+    return {energy, zenith};
+}
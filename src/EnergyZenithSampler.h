@@ -0,0 +1,39 @@
+#pragma once
+
+#include <TH2D.h>
+
+#include <span>
+#include <utility>
+#include <vector>
+
+// Immutable sampler of the (energy, zenith) distribution of an input histogram.
+// Built once from the TH2D (or from the tables of a compiled input), it can then be used concurrently from any number
+// of threads without locking
+class EnergyZenithSampler {
+public:
+    explicit EnergyZenithSampler(const TH2D &hist);
+
+    // non-owning, e.g. over a memory mapped compiled input which must outlive the sampler
+    EnergyZenithSampler(std::span<const double> energyEdges, std::span<const double> zenithEdges,
+                        std::span<const double> cumulative);
+
+    EnergyZenithSampler(const EnergyZenithSampler &) = delete;
+
+    EnergyZenithSampler &operator=(const EnergyZenithSampler &) = delete;
+
+    // equivalent to TH2D::GetRandom2 but using the provided uniform random numbers in [0, 1)
+    std::pair<double, double> Sample(double randomBin, double randomEnergy, double randomZenith) const;
+
+    std::span<const double> GetEnergyEdges() const { return energyEdges; }
+
+    std::span<const double> GetZenithEdges() const { return zenithEdges; }
+
+    std::span<const double> GetCumulative() const { return cumulative; }
+
+private:
+    std::vector<double> storage; // edges and cumulative distribution when built from a histogram
+
+    std::span<const double> energyEdges;
+    std::span<const double> zenithEdges;
+    std::span<const double> cumulative; // normalized cumulative distribution of the flattened (energy, zenith) bins
+};
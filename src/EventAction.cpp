@@ -12,4 +12,6 @@ EventAction::EventAction() : G4UserEventAction() {}
 
 void EventAction::BeginOfEventAction(const G4Event *event) {}
 
-void EventAction::EndOfEventAction(const G4Event *event) {}
+void EventAction::EndOfEventAction(const G4Event *event) {
+    RunAction::EndOfEvent(event);
+}
@@ -0,0 +1,128 @@
+#include "HitRecorder.h"
+
+#include <G4SystemOfUnits.hh>
+
+#include <Compression.h>
+#include <TMath.h>
+#include <TNamed.h>
+
+using namespace std;
+using namespace CLHEP;
+
+unique_ptr<ROOT::TBufferMerger> HitRecorder::merger = nullptr;
+mutex HitRecorder::writersMutex;
+vector<unique_ptr<HitRecorder::Writer>> HitRecorder::writers = {};
+G4ThreadLocal HitRecorder::Writer *HitRecorder::threadWriter = nullptr;
+
+unsigned int HitRecorder::run = 0;
+vector<pair<unsigned int, string>> HitRecorder::runDescriptions = {};
+
+G4ThreadLocal HitRecorder::Hit HitRecorder::threadEventPrimary = {};
+
+void HitRecorder::Open(const string &filename) {
+    merger = make_unique<ROOT::TBufferMerger>(filename.c_str(), "RECREATE",
+                                              ROOT::CompressionSettings(ROOT::kZSTD, 5));
+}
+
+void HitRecorder::SetRun(unsigned int index, const string &description) {
+    run = index;
+    runDescriptions.emplace_back(index, description);
+}
+
+void HitRecorder::SetEventPrimary(int event, InputParticle particle, double energy, double zenith) {
+    threadEventPrimary.event = event;
+    threadEventPrimary.primary = ToIndex(particle);
+    threadEventPrimary.primaryEnergy = (Float_t) energy;
+    threadEventPrimary.primaryZenith = (Float_t) zenith;
+}
+
+HitRecorder::Writer *HitRecorder::GetThreadWriter() {
+    if (threadWriter != nullptr) {
+        return threadWriter;
+    }
+
+    lock_guard<mutex> lock(writersMutex);
+    auto writer = make_unique<Writer>();
+    writer->file = merger->GetFile();
+    writer->file->cd();
+
+    auto tree = new TTree("hits", "Particles reaching the detector");
+    auto &hit = writer->hit;
+    tree->Branch("run", &hit.run);
+    tree->Branch("event", &hit.event);
+    tree->Branch("primary", &hit.primary);
+    tree->Branch("primary_energy", &hit.primaryEnergy);
+    tree->Branch("primary_zenith", &hit.primaryZenith);
+    tree->Branch("particle", &hit.particle);
+    tree->Branch("energy", &hit.energy);
+    tree->Branch("zenith", &hit.zenith);
+    tree->Branch("azimuth", &hit.azimuth);
+    tree->Branch("x", &hit.x);
+    tree->Branch("y", &hit.y);
+    tree->Branch("time", &hit.time);
+    tree->Branch("weight", &hit.weight);
+    writer->tree = tree;
+    writer->buffer.reserve(bufferSize);
+
+    writers.push_back(std::move(writer));
+    threadWriter = writers.back().get();
+    return threadWriter;
+}
+
+void HitRecorder::Record(OutputParticle particle, const G4Track *track) {
+    const auto writer = GetThreadWriter();
+
+    const auto &direction = track->GetMomentumDirection();
+    const auto &position = track->GetPosition();
+
+    auto hit = threadEventPrimary;
+    hit.run = run;
+    hit.particle = ToIndex(particle);
+    hit.energy = (Float_t) (track->GetKineticEnergy() / MeV);
+    hit.zenith = (Float_t) (TMath::ACos(direction.z()) * TMath::RadToDeg());
+    hit.azimuth = (Float_t) (TMath::ATan2(direction.y(), direction.x()) * TMath::RadToDeg());
+    hit.x = (Float_t) (position.x() / mm);
+    hit.y = (Float_t) (position.y() / mm);
+    hit.time = (Float_t) (track->GetGlobalTime() / ns);
+    hit.weight = (Float_t) track->GetWeight();
+    writer->buffer.push_back(hit);
+
+    if (writer->buffer.size() >= bufferSize) {
+        Flush();
+    }
+}
+
+void HitRecorder::Flush() {
+    if (threadWriter == nullptr || threadWriter->buffer.empty()) {
+        return;
+    }
+
+    for (const auto &hit: threadWriter->buffer) {
+        threadWriter->hit = hit;
+        threadWriter->tree->Fill();
+    }
+    threadWriter->buffer.clear();
+
+    // queued to the merger, the tree is reset and keeps being filled by this thread
+    threadWriter->file->Write();
+}
+
+void HitRecorder::Close() {
+    if (merger == nullptr) {
+        return;
+    }
+
+    {
+        auto file = merger->GetFile();
+        file->cd();
+        for (const auto &[index, description]: runDescriptions) {
+            TNamed(("run_" + to_string(index)).c_str(), description.c_str()).Write();
+        }
+        file->Write();
+    }
+
+    lock_guard<mutex> lock(writersMutex);
+    writers.clear();
+    // the output file is written once all the merger files are gone
+    merger.reset();
+}
@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include <G4Threading.hh>
+#include <G4Track.hh>
+
+#include <ROOT/TBufferMerger.hxx>
+#include <TTree.h>
+
+#include "InputParticle.h"
+#include "OutputHistograms.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Optional record of every hit in a TTree, so that the results can be re-binned or new observables computed offline.
+// Hits are appended to a plain per-thread buffer, which is filled into the thread's own tree in large batches. The
+// trees are sent to a TBufferMerger that compresses and writes them from a single place, no lock is taken per hit
+class HitRecorder {
+public:
+    struct Hit {
+        UInt_t run; // index of the detector configuration
+        UInt_t event;
+        UChar_t primary; // InputParticle
+        Float_t primaryEnergy; // MeV
+        Float_t primaryZenith; // degrees
+        UChar_t particle; // OutputParticle
+        Float_t energy; // MeV
+        Float_t zenith; // degrees
+        Float_t azimuth; // degrees
+        Float_t x; // mm, position on the detector plane
+        Float_t y;
+        Float_t time; // ns
+        Float_t weight;
+    };
+
+    static void Open(const std::string &filename);
+
+    static bool IsEnabled() { return merger != nullptr; }
+
+    // called by the master before each run
+    static void SetRun(unsigned int index, const std::string &description);
+
+    static void SetEventPrimary(int event, InputParticle particle, double energy, double zenith);
+
+    static void Record(OutputParticle particle, const G4Track *track);
+
+    // fills the buffered hits of this thread into its tree and hands them over to the merger
+    static void Flush();
+
+    // must be called once after the last run
+    static void Close();
+
+private:
+    static constexpr std::size_t bufferSize = 1 << 16;
+
+    struct Writer {
+        std::shared_ptr<ROOT::TBufferMergerFile> file;
+        TTree *tree = nullptr; // owned by the file
+        Hit hit{};
+        std::vector<Hit> buffer;
+    };
+
+    static Writer *GetThreadWriter();
+
+    static std::unique_ptr<ROOT::TBufferMerger> merger;
+    static std::mutex writersMutex;
+    static std::vector<std::unique_ptr<Writer>> writers;
+    static G4ThreadLocal Writer *threadWriter;
+
+    static unsigned int run;
+    static std::vector<std::pair<unsigned int, std::string>> runDescriptions;
+
+    static G4ThreadLocal Hit threadEventPrimary; // primary fields of the event being processed
+};
@@ -0,0 +1,99 @@
+#include "InputCache.h"
+
+#include <TFile.h>
+#include <TMD5.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+string GetStringHash(const string &value) {
+    TMD5 md5;
+    md5.Update((const UChar_t *) value.data(), value.size());
+    md5.Final();
+    return md5.AsString();
+}
+
+// written next to the final file and renamed, concurrent jobs never see a partial file
+void WriteAtomically(const filesystem::path &filename, const string &content) {
+    const auto temporaryFilename = filename.string() + ".tmp." + to_string(getpid());
+    ofstream(temporaryFilename) << content;
+    filesystem::rename(temporaryFilename, filename);
+}
+} // namespace
+
+string InputCache::GetDefaultDirectory() {
+    if (const auto cache = getenv("XDG_CACHE_HOME"); cache != nullptr && *cache != '\0') {
+        return (filesystem::path(cache) / "radiation-transmission").string();
+    }
+    if (const auto home = getenv("HOME"); home != nullptr && *home != '\0') {
+        return (filesystem::path(home) / ".cache" / "radiation-transmission").string();
+    }
+    return ".radiation-transmission-cache";
+}
+
+bool InputCache::IsRemote(const string &filename) {
+    for (const auto protocol: {"http://", "https://", "root://"}) {
+        if (filename.rfind(protocol, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+string InputCache::Resolve(const string &filename, const string &directory, bool offline) {
+    if (!IsRemote(filename)) {
+        return filename;
+    }
+
+    const auto index = filesystem::path(directory) / "urls" / GetStringHash(filename);
+    if (filesystem::exists(index)) {
+        string contentHash;
+        ifstream(index) >> contentHash;
+        const auto object = filesystem::path(directory) / "objects" / contentHash;
+        if (!contentHash.empty() && filesystem::exists(object)) {
+            return object.string();
+        }
+    }
+
+    if (offline) {
+        throw runtime_error("InputCache::Resolve: " + filename + " is not in the cache " + directory +
+                            " and network access is disabled, run 'prefetch' first");
+    }
+    return Fetch(filename, directory);
+}
+
+string InputCache::Fetch(const string &url, const string &directory) {
+    const auto objects = filesystem::path(directory) / "objects";
+    const auto urls = filesystem::path(directory) / "urls";
+    filesystem::create_directories(objects);
+    filesystem::create_directories(urls);
+
+    cout << "Downloading " << url << " into the input cache " << directory << endl;
+    const auto temporaryFilename = (objects / ("download.tmp." + to_string(getpid()))).string();
+    if (!TFile::Cp(url.c_str(), temporaryFilename.c_str(), false)) {
+        filesystem::remove(temporaryFilename);
+        throw runtime_error("InputCache::Fetch: could not download " + url);
+    }
+
+    const auto checksum = unique_ptr<TMD5>(TMD5::FileChecksum(temporaryFilename.c_str()));
+    if (!checksum) {
+        filesystem::remove(temporaryFilename);
+        throw runtime_error("InputCache::Fetch: could not compute the checksum of " + url);
+    }
+    const auto object = objects / checksum->AsString();
+    // identical content downloaded concurrently or from another url ends up in the same object
+    filesystem::rename(temporaryFilename, object);
+
+    WriteAtomically(urls / GetStringHash(url), checksum->AsString());
+
+    return object.string();
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+// Local content-addressed cache of remote input files.
+// 'urls/<md5 of the url>' holds the content hash of the file downloaded from that url, 'objects/<md5 of the content>'
+// holds the file itself. Once cached, resolving a url does no network I/O
+class InputCache {
+public:
+    // $XDG_CACHE_HOME/radiation-transmission, or ~/.cache/radiation-transmission
+    static std::string GetDefaultDirectory();
+
+    static bool IsRemote(const std::string &filename);
+
+    // local path of the file: unchanged for local files, from the cache (downloaded first if needed) for remote files.
+    // In offline mode a remote file missing from the cache is an error
+    static std::string Resolve(const std::string &filename, const std::string &directory, bool offline);
+
+    // downloads the file into the cache even if it is already there, e.g. to pick up a new version
+    static std::string Fetch(const std::string &url, const std::string &directory);
+};
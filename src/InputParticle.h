@@ -0,0 +1,40 @@
+
+#pragma once
+
+#include <array>
+#include <stdexcept>
+#include <string>
+
+// Particle species available in the input distributions, used as a compact index in the hot paths
+enum class InputParticle : unsigned int {
+    neutron,
+    gamma,
+    proton,
+    electron,
+    muon,
+};
+
+constexpr std::size_t inputParticlesN = 5;
+
+constexpr std::array<InputParticle, inputParticlesN> inputParticlesAll = {
+        InputParticle::neutron, InputParticle::gamma, InputParticle::proton, InputParticle::electron,
+        InputParticle::muon};
+
+constexpr std::size_t ToIndex(InputParticle particle) {
+    return static_cast<std::size_t>(particle);
+}
+
+// name as used in the input files and the command line ("neutron", "muon", etc.)
+inline std::string GetInputParticleName(InputParticle particle) {
+    constexpr std::array<const char *, inputParticlesN> names = {"neutron", "gamma", "proton", "electron", "muon"};
+    return names[ToIndex(particle)];
+}
+
+inline InputParticle GetInputParticleFromName(const std::string &particleName) {
+    for (const auto particle: inputParticlesAll) {
+        if (GetInputParticleName(particle) == particleName) {
+            return particle;
+        }
+    }
+    throw std::runtime_error("GetInputParticleFromName: unknown input particle name: " + particleName);
+}
@@ -0,0 +1,39 @@
+
+#pragma once
+
+#include <TFile.h>
+
+#include "InputParticle.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Settings and state of one job: the runs of its detector configurations, written into one output file. The command
+// line runs a single job, the server ('--serve', see JobServer) runs one job after the other in the same process. Each
+// job starts from a fresh context, so nothing of a previous job (particle selection, weights, output file) leaks into it
+struct JobContext {
+    std::set<std::string> inputParticleNames;
+    int requestedPrimaries = 0;
+    int requestedSecondaries = 0;
+    std::string outputFilename;
+
+    // the results are written unnormalised, with the launched primaries per input particle, so that the shards of a
+    // run split across processes can be merged and normalised once
+    unsigned int shardIndex = 0;
+    unsigned int shardsN = 0; // 0 if not sharded
+    long shardRandomSeed = 0;
+
+    // results of the current run are written into this directory of the output file (top level if empty), the title
+    // describes the detector configuration
+    std::string outputDirectoryName;
+    std::string outputDirectoryTitle;
+
+    // derived by the master before the first run, read-only during the runs
+    std::map<std::string, double> inputParticleWeights; // relative weights of the selected particles
+    std::vector<std::pair<InputParticle, double>> inputParticlesCumulativeWeights;
+
+    TFile *outputFile = nullptr; // opened by the first run, closed by RunAction::EndJob
+};
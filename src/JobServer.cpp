@@ -0,0 +1,189 @@
+
+#include "JobServer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+sockaddr_un GetAddress(const string &socketPath) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw runtime_error("JobServer: socket path too long: " + socketPath);
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+// up to the end of the line or of the stream, false if the connection failed or stayed silent past the timeout (-1 to
+// wait forever)
+bool ReadLine(int connection, string &line, int timeoutMilliseconds = -1) {
+    const auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMilliseconds);
+    while (true) {
+        if (timeoutMilliseconds >= 0) {
+            const auto remaining = chrono::duration_cast<chrono::milliseconds>(
+                    deadline - chrono::steady_clock::now()).count();
+            pollfd request = {connection, POLLIN, 0};
+            const int ready = remaining > 0 ? poll(&request, 1, (int) remaining) : 0;
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+        }
+        char character;
+        const auto n = read(connection, &character, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0 || character == '\n') {
+            return true;
+        }
+        line += character;
+    }
+}
+
+void WriteAll(int connection, const string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        // no SIGPIPE if the client went away
+        const auto n = send(connection, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return; // the client went away, its job is done anyway
+        }
+        written += n;
+    }
+}
+} // namespace
+
+JobServer::JobServer(const string &socketPath) : socketPath(socketPath) {
+    const auto address = GetAddress(socketPath);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw runtime_error("JobServer::JobServer: could not create socket: " + string(strerror(errno)));
+    }
+    // only a socket left by a previous server that was not shut down cleanly is replaced, never another file or the
+    // socket of a running server
+    struct stat status = {};
+    if (lstat(socketPath.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            close(listener);
+            throw runtime_error("JobServer::JobServer: " + socketPath + " exists and is not a socket");
+        }
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        const bool running = probe >= 0 && connect(probe, (const sockaddr *) &address, sizeof(address)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (running) {
+            close(listener);
+            throw runtime_error("JobServer::JobServer: a server is already listening on " + socketPath);
+        }
+        unlink(socketPath.c_str());
+    }
+    if (bind(listener, (const sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        const string error = strerror(errno);
+        close(listener);
+        throw runtime_error("JobServer::JobServer: could not listen on " + socketPath + ": " + error);
+    }
+    listenerThread = thread(&JobServer::Listen, this);
+}
+
+JobServer::~JobServer() {
+    // unblocks the accept of the listener if it is still waiting
+    shutdown(listener, SHUT_RDWR);
+    if (listenerThread.joinable()) {
+        listenerThread.join();
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+
+    // jobs that will never run
+    for (const auto &job: queue) {
+        Reply(job, "error server stopped");
+    }
+}
+
+void JobServer::Listen() {
+    while (true) {
+        const int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // the socket was shut down
+        }
+
+        // a client that connects and sends nothing cannot hold back the ones behind it for longer than the timeout
+        string options;
+        if (!ReadLine(connection, options, readTimeoutMilliseconds)) {
+            WriteAll(connection, "error no job received within " + to_string(readTimeoutMilliseconds / 1000) + " s\n");
+            close(connection);
+            continue;
+        }
+        if (options.empty()) {
+            // nothing submitted, e.g. the probe of another server checking whether this one is running
+            close(connection);
+            continue;
+        }
+        lock_guard<mutex> lock(queueMutex);
+        if (options == "shutdown") {
+            WriteAll(connection, "ok\n");
+            close(connection);
+            shutdownRequested = true;
+            queueCondition.notify_one();
+            break;
+        }
+        queue.push_back({connection, std::move(options)});
+        queueCondition.notify_one();
+    }
+}
+
+optional<JobServer::Job> JobServer::Next() {
+    unique_lock<mutex> lock(queueMutex);
+    queueCondition.wait(lock, [this] { return !queue.empty() || shutdownRequested; });
+    if (queue.empty()) {
+        return nullopt;
+    }
+    auto job = std::move(queue.front());
+    queue.pop_front();
+    return job;
+}
+
+void JobServer::Reply(const Job &job, const string &message) {
+    WriteAll(job.connection, message + "\n");
+    close(job.connection);
+}
+
+string JobServer::Submit(const string &socketPath, const string &options) {
+    const auto address = GetAddress(socketPath);
+    const int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (const sockaddr *) &address, sizeof(address)) != 0) {
+        const string error = strerror(errno);
+        if (connection >= 0) {
+            close(connection);
+        }
+        throw runtime_error("JobServer::Submit: could not connect to " + socketPath + ": " + error);
+    }
+    WriteAll(connection, options + "\n");
+    // the answer comes once the job has run, however long it takes
+    string answer;
+    ReadLine(connection, answer);
+    close(connection);
+    return answer;
+}
@@ -0,0 +1,54 @@
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+// Jobs of the warm simulation server ('--serve'), received on a Unix domain socket. A job is a single line with its
+// options, in the same syntax as the command line (e.g. '-n 100000 -p neutron -d G4_Pb 100 -o out.root'). A listener
+// thread accepts the connections and queues their jobs, the main thread runs them one after the other on the worker
+// threads of the run manager and answers each connection once its job is done. The line 'shutdown' stops the server
+// after the jobs queued before it
+class JobServer {
+public:
+    struct Job {
+        int connection; // answered with Reply
+        std::string options;
+    };
+
+    explicit JobServer(const std::string &socketPath);
+
+    ~JobServer(); // stops listening and removes the socket
+
+    JobServer(const JobServer &) = delete;
+
+    JobServer &operator=(const JobServer &) = delete;
+
+    // blocks until a job is queued, empty once the server is shut down and the queue is drained
+    std::optional<Job> Next();
+
+    // single line answer ('ok ...' or 'error ...'), closes the connection
+    static void Reply(const Job &job, const std::string &message);
+
+    // sends a job to a running server and waits for its answer
+    static std::string Submit(const std::string &socketPath, const std::string &options);
+
+private:
+    // for the line of a job, once its connection is accepted
+    static constexpr int readTimeoutMilliseconds = 5000;
+
+    void Listen();
+
+    std::string socketPath;
+    int listener = -1;
+    std::thread listenerThread;
+
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    std::deque<Job> queue;
+    bool shutdownRequested = false;
+};
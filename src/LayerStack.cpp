@@ -0,0 +1,260 @@
+
+#include "LayerStack.h"
+
+#include "CompiledInput.h"
+#include "ResponseMatrix.h"
+
+#include <TAxis.h>
+#include <TFile.h>
+#include <TH1D.h>
+#include <THnSparse.h>
+#include <TKey.h>
+#include <TList.h>
+#include <TNamed.h>
+#include <TParameter.h>
+
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+bool HaveSameBinning(const TAxis &axis, const TAxis &other) {
+    if (axis.GetNbins() != other.GetNbins()) {
+        return false;
+    }
+    for (int i = 1; i <= axis.GetNbins() + 1; ++i) {
+        const double edge = axis.GetBinLowEdge(i);
+        if (abs(edge - other.GetBinLowEdge(i)) > 1E-9 * max(1.0, abs(edge))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// empty copy, same name and binning
+unique_ptr<TH2D> MakeEmpty(const TH2D &spectrum) {
+    auto empty = unique_ptr<TH2D>((TH2D *) spectrum.Clone());
+    empty->Reset();
+    return empty;
+}
+} // namespace
+
+LayerStack::Spectra LayerStack::LoadSpectra(const string &inputFilename, const set<string> &particleNames,
+                                            string &latitude) {
+    Spectra spectra;
+    if (CompiledInput::IsCompiled(inputFilename)) {
+        const CompiledInput input(inputFilename);
+        latitude = input.GetLatitude();
+        for (const auto particle: inputParticlesAll) {
+            const auto [energyZenith, energy, zenith] = input.MakeHistograms(particle);
+            delete energy;
+            delete zenith;
+            spectra[ToIndex(particle)].reset(energyZenith);
+        }
+    } else {
+        const auto file = unique_ptr<TFile>(TFile::Open(inputFilename.c_str(), "READ"));
+        if (!file || file->IsZombie()) {
+            throw runtime_error("LayerStack::LoadSpectra: could not open " + inputFilename);
+        }
+        if (const auto inputLatitude = unique_ptr<TNamed>(file->Get<TNamed>("latitude"))) {
+            latitude = inputLatitude->GetTitle();
+        }
+        for (const auto particle: inputParticlesAll) {
+            const auto name = GetInputParticleName(particle) + "_energy_zenith";
+            spectra[ToIndex(particle)].reset(file->Get<TH2D>(name.c_str()));
+            if (!spectra[ToIndex(particle)]) {
+                throw runtime_error("LayerStack::LoadSpectra: " + name + " not found in " + inputFilename);
+            }
+        }
+    }
+
+    for (const auto particle: inputParticlesAll) {
+        auto &spectrum = spectra[ToIndex(particle)];
+        spectrum->SetName((GetInputParticleName(particle) + "_energy_zenith").c_str());
+        if (particleNames.count(GetInputParticleName(particle)) == 0) {
+            spectrum->Reset();
+        }
+    }
+    return spectra;
+}
+
+string LayerStack::GetBinningDescription(const Spectra &spectra) {
+    ostringstream description;
+    description.precision(17);
+    for (const auto particle: inputParticlesAll) {
+        const auto &spectrum = spectra[ToIndex(particle)];
+        description << GetInputParticleName(particle);
+        for (const auto axis: {spectrum->GetXaxis(), spectrum->GetYaxis()}) {
+            description << "\n";
+            for (int i = 1; i <= axis->GetNbins() + 1; ++i) {
+                description << axis->GetBinLowEdge(i) << " ";
+            }
+        }
+        description << "\n";
+    }
+    return description.str();
+}
+
+void LayerStack::Store(TDirectory *source, const string &filename) {
+    filesystem::create_directories(filesystem::path(filename).parent_path());
+    const auto temporaryFilename = filename + ".tmp." + to_string(getpid());
+    {
+        const auto file = unique_ptr<TFile>(TFile::Open(temporaryFilename.c_str(), "RECREATE"));
+        if (!file || file->IsZombie()) {
+            throw runtime_error("LayerStack::Store: could not create " + temporaryFilename);
+        }
+        // the matrices and the detector description, not the directories of the other layers
+        for (const auto object: *source->GetListOfKeys()) {
+            const auto key = (TKey *) object;
+            if (string(key->GetClassName()) == "TDirectoryFile") {
+                continue;
+            }
+            const auto stored = unique_ptr<TObject>(key->ReadObj());
+            file->cd();
+            stored->Write(key->GetName());
+        }
+        file->Close();
+    }
+    filesystem::rename(temporaryFilename, filename);
+}
+
+LayerStack::Spectra LayerStack::Apply(TDirectory *layer, const Spectra &spectra, double &lostFlux) {
+    Spectra result;
+    for (const auto family: inputParticlesAll) {
+        result[ToIndex(family)] = MakeEmpty(*spectra[ToIndex(family)]);
+    }
+
+    // out_f(b') = sum over p and b of flux_p(b) / primaries_p(b) * transfer_p->f(b, b')
+    for (const auto input: inputParticlesAll) {
+        const auto &spectrum = spectra[ToIndex(input)];
+        if (spectrum->Integral() <= 0) {
+            continue;
+        }
+        const auto primariesName = ResponseMatrix::GetPrimariesName(ResponseMatrix::Grid::transfer, input);
+        const auto primaries = unique_ptr<TH2D>(layer->Get<TH2D>(primariesName.c_str()));
+        if (!primaries) {
+            throw runtime_error("LayerStack::Apply: " + primariesName + " not found in " + layer->GetName());
+        }
+        if (!HaveSameBinning(*primaries->GetXaxis(), *spectrum->GetXaxis()) ||
+            !HaveSameBinning(*primaries->GetYaxis(), *spectrum->GetYaxis())) {
+            throw runtime_error("LayerStack::Apply: the " + GetInputParticleName(input) +
+                                " spectrum does not have the binning of the operator in " + layer->GetName());
+        }
+
+        // scale of each input bin and its variance, from the uncertainty of the incoming spectrum
+        const int energyBinsN = primaries->GetNbinsX();
+        const int zenithBinsN = primaries->GetNbinsY();
+        vector<double> factors((energyBinsN + 2) * (zenithBinsN + 2), 0);
+        vector<double> factorVariances(factors.size(), 0);
+        for (int j = 1; j <= zenithBinsN; ++j) {
+            for (int i = 1; i <= energyBinsN; ++i) {
+                const double flux = max(0.0, spectrum->GetBinContent(i, j));
+                const double launched = primaries->GetBinContent(i, j);
+                if (launched > 0) {
+                    const double error = spectrum->GetBinError(i, j);
+                    factors[j * (energyBinsN + 2) + i] = flux / launched;
+                    factorVariances[j * (energyBinsN + 2) + i] = error * error / (launched * launched);
+                } else {
+                    lostFlux += flux;
+                }
+            }
+        }
+
+        for (const auto family: inputParticlesAll) {
+            const auto responseName = ResponseMatrix::GetResponseName(ResponseMatrix::Grid::transfer, input,
+                                                                      GetInputParticleName(family));
+            const auto response = unique_ptr<THnSparse>(layer->Get<THnSparse>(responseName.c_str()));
+            if (!response) {
+                throw runtime_error("LayerStack::Apply: " + responseName + " not found in " + layer->GetName());
+            }
+            auto &outgoing = result[ToIndex(family)];
+
+            // only the filled bins are visited
+            array<int, 4> coordinates = {};
+            for (Long64_t bin = 0; bin < response->GetNbins(); ++bin) {
+                const double content = response->GetBinContent(bin, coordinates.data());
+                const auto slot = coordinates[1] * (energyBinsN + 2) + coordinates[0];
+                const double factor = factors[slot];
+                if (factor == 0) {
+                    continue;
+                }
+                const auto [i, j] = pair<int, int>{coordinates[2], coordinates[3]};
+                if (i < 1 || i > outgoing->GetNbinsX() || j < 1 || j > outgoing->GetNbinsY()) {
+                    lostFlux += content * factor;
+                    continue;
+                }
+                // the uncertainties of the layers are combined as if independent between output bins
+                const double error = outgoing->GetBinError(i, j);
+                outgoing->SetBinContent(i, j, outgoing->GetBinContent(i, j) + content * factor);
+                outgoing->SetBinError(i, j, sqrt(error * error + response->GetBinError2(bin) * factor * factor +
+                                                 content * content * factorVariances[slot]));
+            }
+        }
+    }
+    return result;
+}
+
+void LayerStack::Write(TDirectory *directory, const Spectra &spectra, const string &prefix) {
+    directory->cd();
+    for (const auto particle: inputParticlesAll) {
+        const auto &spectrum = spectra[ToIndex(particle)];
+        const auto name = prefix + GetInputParticleName(particle);
+        spectrum->SetName((name + "_energy_zenith").c_str());
+        // the species of an input are weighted by their entries, which must then be proportional to their flux and
+        // not to the number of bins set
+        const double flux = spectrum->Integral();
+        spectrum->SetEntries(flux);
+        spectrum->Write();
+        const auto energy = unique_ptr<TH1D>(spectrum->ProjectionX((name + "_energy").c_str(), 1,
+                                                                   spectrum->GetNbinsY(), "e"));
+        energy->SetEntries(flux);
+        energy->Write();
+        const auto zenith = unique_ptr<TH1D>(spectrum->ProjectionY((name + "_zenith").c_str(), 1,
+                                                                   spectrum->GetNbinsX(), "e"));
+        zenith->SetEntries(flux);
+        zenith->Write();
+    }
+}
+
+void LayerStack::Compare(TDirectory *directory, const Spectra &composed, const Spectra &direct) {
+    directory->cd();
+    cout << "Composed stack against the direct simulation:" << endl;
+    for (const auto particle: inputParticlesAll) {
+        const auto &composedSpectrum = composed[ToIndex(particle)];
+        const auto &directSpectrum = direct[ToIndex(particle)];
+        const auto name = GetInputParticleName(particle);
+
+        double chi2 = 0;
+        int ndf = 0;
+        for (int j = 1; j <= directSpectrum->GetNbinsY(); ++j) {
+            for (int i = 1; i <= directSpectrum->GetNbinsX(); ++i) {
+                const double difference = composedSpectrum->GetBinContent(i, j) - directSpectrum->GetBinContent(i, j);
+                const double variance = pow(composedSpectrum->GetBinError(i, j), 2) +
+                                        pow(directSpectrum->GetBinError(i, j), 2);
+                if (variance <= 0) {
+                    continue;
+                }
+                chi2 += difference * difference / variance;
+                ndf++;
+            }
+        }
+
+        const double directIntegral = directSpectrum->Integral();
+        // -1 when the family does not reach the detector in the direct simulation
+        const double relativeDifference = directIntegral > 0 ? composedSpectrum->Integral() / directIntegral - 1 : -1;
+        const double chi2PerDegree = ndf > 0 ? chi2 / ndf : -1;
+        if (directIntegral > 0) {
+            cout << "    - " << name << "s: relative difference " << relativeDifference << ", chi2 / ndf "
+                 << chi2PerDegree << endl;
+        }
+        TParameter<double>(("check_" + name + "_relative_difference").c_str(), relativeDifference).Write();
+        TParameter<double>(("check_" + name + "_chi2_ndf").c_str(), chi2PerDegree).Write();
+    }
+}
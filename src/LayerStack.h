@@ -0,0 +1,48 @@
+
+#pragma once
+
+#include <TDirectory.h>
+#include <TH2D.h>
+
+#include "InputParticle.h"
+
+#include <array>
+#include <memory>
+#include <set>
+#include <string>
+
+// Composition of detector stacks from the transfer operators of their layers. The operator of a layer is the transfer
+// matrix written with the 'transfer' grid of ResponseMatrix: for each incoming species family and (energy, zenith) bin,
+// the flux of every family per (energy, zenith) bin reaching the bottom of the layer, with the input binning of that
+// family. Applying the operators one after the other maps the input spectra onto the spectra below the stack.
+// Approximations: particles going back up between two layers are lost, and both charge states of a family enter the
+// next layer as the species simulated for that family (e.g. mu+ as mu-)
+class LayerStack {
+public:
+    // (energy, zenith) spectrum of each species family, with the binning of its input distribution
+    using Spectra = std::array<std::unique_ptr<TH2D>, inputParticlesN>;
+
+    // input distributions of a root or compiled input. All the families are loaded, those not in 'particleNames' are
+    // empty so that they are still available as outgoing binning
+    static Spectra LoadSpectra(const std::string &inputFilename, const std::set<std::string> &particleNames,
+                               std::string &latitude);
+
+    // edges of all the binnings, an operator is only valid for the binning it was computed with
+    static std::string GetBinningDescription(const Spectra &spectra);
+
+    // copies the operator written by the simulation into its cache file, through a temporary file renamed once
+    // complete so that concurrent jobs never read a partial operator
+    static void Store(TDirectory *source, const std::string &filename);
+
+    // spectra below a layer from the spectra entering it. 'lostFlux' accumulates the flux entering bins without any
+    // simulated primary, and the flux leaving the layer out of the binning
+    static Spectra Apply(TDirectory *layer, const Spectra &spectra, double &lostFlux);
+
+    // '<prefix><family>_energy_zenith', '<prefix><family>_energy' and '<prefix><family>_zenith', the same layout as an
+    // input file, so that the result can also be used as the input of another simulation
+    static void Write(TDirectory *directory, const Spectra &spectra, const std::string &prefix = "");
+
+    // integral relative difference and chi2 / ndf per family of the composed spectra against the direct ones, printed
+    // and written as 'check_<family>_relative_difference' and 'check_<family>_chi2_ndf'
+    static void Compare(TDirectory *directory, const Spectra &composed, const Spectra &direct);
+};
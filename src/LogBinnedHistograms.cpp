@@ -0,0 +1,202 @@
+
+#include "LogBinnedHistograms.h"
+
+#include <TMath.h>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+constexpr int binsN = (LogBinnedHistograms::energyBinsN + 2) * (LogBinnedHistograms::zenithBinsN + 2);
+
+// the bin TAxis::FindBin would return: the analytic guess can be off by one next to an edge because of rounding, it is
+// corrected against the edges themselves
+int GetEnergyBin(double energy, double logEnergy, const vector<double> &edges) {
+    constexpr int n = LogBinnedHistograms::energyBinsN;
+    if (energy < edges[0]) {
+        return 0;
+    }
+    if (!(energy < edges[n])) {
+        return n + 1; // NaN included
+    }
+    const double logMin = log10(LogBinnedHistograms::energyMin);
+    const double logMax = log10(LogBinnedHistograms::energyMax);
+    int bin = 1 + int((logEnergy - logMin) * n / (logMax - logMin));
+    bin = max(1, min(bin, n));
+    if (energy < edges[bin - 1]) {
+        bin--;
+    } else if (energy >= edges[bin]) {
+        bin++;
+    }
+    return bin;
+}
+
+// same expression as TAxis::FindBin for fixed bins
+int GetZenithBin(double zenith) {
+    constexpr int n = LogBinnedHistograms::zenithBinsN;
+    constexpr double min = LogBinnedHistograms::zenithMin;
+    constexpr double max = LogBinnedHistograms::zenithMax;
+    if (zenith < min) {
+        return 0;
+    }
+    if (!(zenith < max)) {
+        return n + 1;
+    }
+    return 1 + int(n * (zenith - min) / (max - min));
+}
+} // namespace
+
+const vector<double> &LogBinnedHistograms::GetEnergyEdges() {
+    static const vector<double> edges = [] {
+        vector<double> values(energyBinsN + 1);
+        for (int i = 0; i <= energyBinsN; ++i) {
+            values[i] = TMath::Power(10, (TMath::Log10(energyMin) +
+                                          i * (TMath::Log10(energyMax) - TMath::Log10(energyMin)) / energyBinsN));
+        }
+        return values;
+    }();
+    return edges;
+}
+
+LogBinnedHistograms::LogBinnedHistograms(size_t particlesN)
+        : sumw(particlesN, vector<double>(binsN, 0)), sumw2(particlesN, vector<double>(binsN, 0)),
+          entries(particlesN, 0), energyStats(particlesN, {0, 0, 0, 0}), zenithStats(particlesN, {0, 0, 0, 0}),
+          energyZenithStats(particlesN, {0, 0, 0, 0, 0, 0, 0}), weighted(particlesN, false) {}
+
+void LogBinnedHistograms::Bin() {
+    const auto &edges = GetEnergyEdges();
+
+    // no dependency between the hits, the math functions of a whole batch are evaluated one after the other
+    for (size_t i = 0; i < bufferSize; ++i) {
+        logEnergies[i] = log10(bufferEnergies[i]);
+    }
+    for (size_t i = 0; i < bufferSize; ++i) {
+        zeniths[i] = TMath::ACos(bufferCosZeniths[i]) * TMath::RadToDeg();
+    }
+    for (size_t i = 0; i < bufferSize; ++i) {
+        energyBins[i] = GetEnergyBin(bufferEnergies[i], logEnergies[i], edges);
+        zenithBins[i] = GetZenithBin(zeniths[i]);
+    }
+
+    for (size_t i = 0; i < bufferSize; ++i) {
+        const auto particle = bufferParticles[i];
+        const double weight = bufferWeights[i];
+        const int bin = energyBins[i] + (energyBinsN + 2) * zenithBins[i];
+        sumw[particle][bin] += weight;
+        sumw2[particle][bin] += weight * weight;
+        entries[particle]++;
+        if (weight != 1) {
+            weighted[particle] = true;
+        }
+
+        // as TH1::Fill, the hits in the under- and overflows do not enter the statistics
+        const double energy = bufferEnergies[i];
+        const double zenith = zeniths[i];
+        const bool energyInRange = energyBins[i] >= 1 && energyBins[i] <= energyBinsN;
+        const bool zenithInRange = zenithBins[i] >= 1 && zenithBins[i] <= zenithBinsN;
+        if (energyInRange) {
+            auto &stats = energyStats[particle];
+            stats[0] += weight;
+            stats[1] += weight * weight;
+            stats[2] += weight * energy;
+            stats[3] += weight * energy * energy;
+        }
+        if (zenithInRange) {
+            auto &stats = zenithStats[particle];
+            stats[0] += weight;
+            stats[1] += weight * weight;
+            stats[2] += weight * zenith;
+            stats[3] += weight * zenith * zenith;
+        }
+        if (energyInRange && zenithInRange) {
+            auto &stats = energyZenithStats[particle];
+            stats[0] += weight;
+            stats[1] += weight * weight;
+            stats[2] += weight * energy;
+            stats[3] += weight * energy * energy;
+            stats[4] += weight * zenith;
+            stats[5] += weight * zenith * zenith;
+            stats[6] += weight * energy * zenith;
+        }
+    }
+    bufferSize = 0;
+}
+
+void LogBinnedHistograms::AddTo(size_t particle, TH1D &energy, TH1D &zenith, TH2D &energyZenith) {
+    Bin();
+    if (entries[particle] == 0) {
+        return;
+    }
+
+    const auto &contents = sumw[particle];
+    const auto &squares = sumw2[particle];
+    for (TH1 *hist: {(TH1 *) &energy, (TH1 *) &zenith, (TH1 *) &energyZenith}) {
+        if (weighted[particle] && hist->GetSumw2N() == 0) {
+            hist->Sumw2();
+        }
+    }
+
+    // the statistics are taken before the contents change: ROOT computes the ones of a histogram with no fills yet
+    // from its bin centres
+    TH1 *hists[] = {&energy, &zenith, &energyZenith};
+    const double *batchStats[] = {energyStats[particle].data(), zenithStats[particle].data(),
+                                  energyZenithStats[particle].data()};
+    const size_t batchStatsN[] = {4, 4, 7};
+    array<array<double, TH1::kNstat>, 3> stats{};
+    array<double, 3> histEntries{};
+    for (size_t h = 0; h < 3; ++h) {
+        histEntries[h] = hists[h]->GetEntries();
+        hists[h]->GetStats(stats[h].data());
+    }
+
+    // the 1D histograms are the projections of the 2D one, flows included
+    for (int j = 0; j < zenithBinsN + 2; ++j) {
+        for (int i = 0; i < energyBinsN + 2; ++i) {
+            const int bin = i + (energyBinsN + 2) * j;
+            if (contents[bin] == 0 && squares[bin] == 0) {
+                continue;
+            }
+            energyZenith.AddBinContent(bin, contents[bin]);
+            energy.AddBinContent(i, contents[bin]);
+            zenith.AddBinContent(j, contents[bin]);
+            if (energyZenith.GetSumw2N() > 0) {
+                energyZenith.GetSumw2()->GetArray()[bin] += squares[bin];
+            }
+            if (energy.GetSumw2N() > 0) {
+                energy.GetSumw2()->GetArray()[i] += squares[bin];
+            }
+            if (zenith.GetSumw2N() > 0) {
+                zenith.GetSumw2()->GetArray()[j] += squares[bin];
+            }
+        }
+    }
+
+    for (size_t h = 0; h < 3; ++h) {
+        for (size_t k = 0; k < batchStatsN[h]; ++k) {
+            stats[h][k] += batchStats[h][k];
+        }
+        hists[h]->PutStats(stats[h].data());
+        hists[h]->SetEntries(histEntries[h] + double(entries[particle]));
+    }
+
+    ClearParticle(particle);
+}
+
+void LogBinnedHistograms::ClearParticle(size_t particle) {
+    fill(sumw[particle].begin(), sumw[particle].end(), 0);
+    fill(sumw2[particle].begin(), sumw2[particle].end(), 0);
+    entries[particle] = 0;
+    energyStats[particle] = {0, 0, 0, 0};
+    zenithStats[particle] = {0, 0, 0, 0};
+    energyZenithStats[particle] = {0, 0, 0, 0, 0, 0, 0};
+    weighted[particle] = false;
+}
+
+void LogBinnedHistograms::Clear() {
+    bufferSize = 0;
+    for (size_t particle = 0; particle < sumw.size(); ++particle) {
+        ClearParticle(particle);
+    }
+}
@@ -0,0 +1,79 @@
+
+#pragma once
+
+#include <TH1D.h>
+#include <TH2D.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Energy / zenith histograms of the hits of one thread, with the binning of the output: bins uniform in log10 of the
+// kinetic energy and uniform in zenith. The energy bin is computed from the logarithm instead of searched in the edges,
+// and the hits are buffered in structure of arrays form and binned in batches, so that the logarithms and arc cosines
+// of a batch are computed in plain loops over arrays. The sums are only added to ROOT histograms (AddTo) when the
+// results of the thread are merged or written
+class LogBinnedHistograms {
+public:
+    static constexpr int energyBinsN = 200;
+    static constexpr double energyMin = 1E-9; // MeV
+    static constexpr double energyMax = 1E8;
+    static constexpr int zenithBinsN = 200;
+    static constexpr double zenithMin = 0; // degrees
+    static constexpr double zenithMax = 90;
+
+    // edges of the energy bins, also the ones of the ROOT histograms so that both bin the same way
+    static const std::vector<double> &GetEnergyEdges();
+
+    explicit LogBinnedHistograms(std::size_t particlesN);
+
+    // the zenith is given by its cosine, the angle is only computed when the batch is binned
+    void Fill(std::size_t particle, double energy, double cosZenith, double weight) {
+        const auto i = bufferSize++;
+        bufferParticles[i] = (std::uint32_t) particle;
+        bufferEnergies[i] = energy;
+        bufferCosZeniths[i] = cosZenith;
+        bufferWeights[i] = weight;
+        if (bufferSize == bufferCapacity) {
+            Bin();
+        }
+    }
+
+    // adds the hits of a particle to its ROOT histograms, with the same contents, errors, entries and statistics (sums
+    // of w, w2, wx, wx2 ... of the hits within the axes, as TH1::Fill) as if they had been filled one by one, up to the
+    // rounding of the sums, and clears them
+    void AddTo(std::size_t particle, TH1D &energy, TH1D &zenith, TH2D &energyZenith);
+
+    void Clear();
+
+private:
+    static constexpr std::size_t bufferCapacity = 1024;
+
+    void Bin();
+
+    void ClearParticle(std::size_t particle);
+
+    std::size_t bufferSize = 0;
+    std::array<std::uint32_t, bufferCapacity> bufferParticles{};
+    std::array<double, bufferCapacity> bufferEnergies{};
+    std::array<double, bufferCapacity> bufferCosZeniths{};
+    std::array<double, bufferCapacity> bufferWeights{};
+
+    // intermediate results of a batch
+    std::array<double, bufferCapacity> logEnergies{};
+    std::array<double, bufferCapacity> zeniths{};
+    std::array<int, bufferCapacity> energyBins{};
+    std::array<int, bufferCapacity> zenithBins{};
+
+    // per particle, sums of the weights and of the squared weights in each (energy, zenith) bin, under- and overflows
+    // included, in the layout of TH2D
+    std::vector<std::vector<double>> sumw;
+    std::vector<std::vector<double>> sumw2;
+    std::vector<unsigned long long> entries;
+    // statistics in the layout of TH1::GetStats: w, w2, wx, wx2 for the 1D histograms, then wy, wy2, wxy for the 2D one
+    std::vector<std::array<double, 4>> energyStats;
+    std::vector<std::array<double, 4>> zenithStats;
+    std::vector<std::array<double, 7>> energyZenithStats;
+    std::vector<bool> weighted; // a weight different from 1 makes ROOT keep the squared weights
+};
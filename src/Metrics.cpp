@@ -0,0 +1,345 @@
+
+#include "Metrics.h"
+#include "RunAction.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+double ToSeconds(unsigned long long nanoseconds) {
+    return double(nanoseconds) * 1E-9;
+}
+}
+
+string Metrics::filename;
+Metrics::Format Metrics::format = Metrics::Format::json;
+double Metrics::interval = 1;
+ofstream Metrics::jsonFile;
+
+unsigned int Metrics::run = 0;
+chrono::steady_clock::time_point Metrics::runStart;
+
+chrono::steady_clock::time_point Metrics::lastTime;
+vector<Metrics::ThreadSample> Metrics::lastSamples;
+
+vector<double> Metrics::tailIdle;
+
+mutex Metrics::countersMutex;
+vector<unique_ptr<Metrics::ThreadCounters>> Metrics::counters = {};
+G4ThreadLocal Metrics::ThreadCounters *Metrics::threadCounters = nullptr;
+
+thread Metrics::reporter;
+mutex Metrics::reporterMutex;
+condition_variable Metrics::reporterCondition;
+bool Metrics::reporterStop = false;
+
+void Metrics::Configure(const string &name, Format newFormat, double newInterval) {
+    filename = name;
+    format = newFormat;
+    interval = newInterval;
+
+    if (!filename.empty() && format == Format::json) {
+        jsonFile.open(filename, ios::trunc);
+        if (!jsonFile) {
+            throw runtime_error("Metrics::Configure: could not open " + filename);
+        }
+    }
+}
+
+void Metrics::Start(unsigned int newRun) {
+    {
+        // the threads of a previous run are idle, their counters start again from zero
+        lock_guard<mutex> lock(countersMutex);
+        for (auto &threadCounters: counters) {
+            threadCounters->events = 0;
+            threadCounters->steps = 0;
+            threadCounters->lockWaitNanoseconds = 0;
+            threadCounters->lastEventNanoseconds = 0;
+            for (auto &hits: threadCounters->hits) {
+                hits = 0;
+            }
+        }
+    }
+
+    run = newRun;
+    runStart = chrono::steady_clock::now();
+    lastTime = runStart;
+    lastSamples.clear();
+
+    cout << "Requested primaries: " << RunAction::GetRequestedPrimaries() << endl;
+    cout << "Requested secondaries: " << RunAction::GetRequestedSecondaries() << endl;
+
+    reporterStop = false;
+    reporter = thread(ReporterLoop);
+}
+
+void Metrics::Stop() {
+    if (!reporter.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(reporterMutex);
+        reporterStop = true;
+    }
+    reporterCondition.notify_all();
+    reporter.join();
+
+    Report(true);
+}
+
+vector<double> Metrics::GetTailIdle() {
+    return tailIdle;
+}
+
+Metrics::ThreadCounters &Metrics::RegisterThread() {
+    lock_guard<mutex> lock(countersMutex);
+    counters.push_back(make_unique<ThreadCounters>());
+    threadCounters = counters.back().get();
+    return *threadCounters;
+}
+
+vector<Metrics::ThreadSample> Metrics::Sample() {
+    lock_guard<mutex> lock(countersMutex);
+    vector<ThreadSample> samples(counters.size());
+    for (size_t i = 0; i < counters.size(); i++) {
+        samples[i].events = counters[i]->events.load(memory_order_relaxed);
+        samples[i].steps = counters[i]->steps.load(memory_order_relaxed);
+        samples[i].lockWaitNanoseconds = counters[i]->lockWaitNanoseconds.load(memory_order_relaxed);
+        samples[i].lastEventNanoseconds = counters[i]->lastEventNanoseconds.load(memory_order_relaxed);
+        for (size_t j = 0; j < outputParticlesN; j++) {
+            samples[i].hits[j] = counters[i]->hits[j].load(memory_order_relaxed);
+        }
+    }
+    return samples;
+}
+
+void Metrics::ReporterLoop() {
+    const auto period = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(interval));
+
+    unique_lock<mutex> lock(reporterMutex);
+    auto next = chrono::steady_clock::now() + period;
+    while (!reporterCondition.wait_until(lock, next, [] { return reporterStop; })) {
+        next += period;
+
+        lock.unlock();
+        Report(false);
+        lock.lock();
+    }
+}
+
+void Metrics::Report(bool final) {
+    const auto now = chrono::steady_clock::now();
+    const auto samples = Sample();
+    const double elapsed = chrono::duration<double>(now - runStart).count();
+    const auto summary = Summarize(samples, elapsed, chrono::duration<double>(now - lastTime).count());
+
+    // progress of the quantity the run is limited by, including the primaries / secondaries of a resumed checkpoint.
+    // The ETA uses the average throughput of this run
+    const bool byPrimaries = RunAction::GetRequestedPrimaries() > 0;
+    const double requested = byPrimaries ? RunAction::GetRequestedPrimaries() : RunAction::GetRequestedSecondaries();
+    const double done = byPrimaries ? RunAction::GetLaunchedPrimaries() : RunAction::GetSecondariesCount();
+    unsigned long long hits = 0;
+    for (const auto particleHits: summary.total.hits) {
+        hits += particleHits;
+    }
+    const double rate = elapsed > 0 ? double(byPrimaries ? summary.total.events : hits) / elapsed : 0;
+    const double progress = requested > 0 ? min(done / requested, 1.0) : 0;
+    const double eta = requested > 0 && rate > 0 ? max(requested - done, 0.0) / rate : NAN;
+
+    if (!final) {
+        cout << "Progress (" << (byPrimaries ? "primaries" : "secondaries") << "): " << (unsigned long long) done
+             << " / " << (unsigned long long) requested << " (" << 100.0 * progress << "%)"
+             << " Elapsed time: " << (long) elapsed << " s"
+             << " Events / s: " << summary.eventsRate << " ETA: ";
+        if (isnan(eta)) {
+            cout << "unknown";
+        } else {
+            cout << (long) eta << " s";
+        }
+        cout << endl;
+    } else if (!summary.threadTailIdle.empty()) {
+        double sum = 0;
+        tailIdle.resize(max(tailIdle.size(), summary.threadTailIdle.size()), 0);
+        for (size_t i = 0; i < summary.threadTailIdle.size(); i++) {
+            sum += summary.threadTailIdle[i];
+            tailIdle[i] += summary.threadTailIdle[i];
+        }
+        cout << "Tail idle time per thread: max "
+             << *max_element(summary.threadTailIdle.begin(), summary.threadTailIdle.end()) << " s, mean "
+             << sum / double(summary.threadTailIdle.size()) << " s" << endl;
+    }
+
+    if (!filename.empty()) {
+        try {
+            if (format == Format::json) {
+                WriteJson(samples, summary, elapsed, progress, eta, final);
+            } else {
+                WritePrometheus(samples, summary, elapsed, progress, eta);
+            }
+        } catch (const exception &error) {
+            cerr << "Metrics: could not write " << filename << ": " << error.what() << endl;
+        }
+    }
+
+    lastTime = now;
+    lastSamples = samples;
+}
+
+Metrics::Summary Metrics::Summarize(const vector<ThreadSample> &samples, double elapsed, double sampleInterval) {
+    Summary summary;
+    unsigned long long maxEvents = 0;
+    const long long start = chrono::duration_cast<chrono::nanoseconds>(runStart.time_since_epoch()).count();
+    long long lastEvent = start;
+    for (const auto &sample: samples) {
+        lastEvent = max(lastEvent, sample.lastEventNanoseconds);
+    }
+    for (size_t i = 0; i < samples.size(); i++) {
+        const auto &sample = samples[i];
+        const auto last = i < lastSamples.size() ? lastSamples[i] : ThreadSample();
+
+        summary.total.events += sample.events;
+        summary.total.steps += sample.steps;
+        summary.total.lockWaitNanoseconds += sample.lockWaitNanoseconds;
+        for (size_t j = 0; j < outputParticlesN; j++) {
+            summary.total.hits[j] += sample.hits[j];
+        }
+        summary.threadRates.push_back(sampleInterval > 0 ? double(sample.events - last.events) / sampleInterval : 0);
+        summary.eventsRate += summary.threadRates.back();
+        summary.stepsRate += sampleInterval > 0 ? double(sample.steps - last.steps) / sampleInterval : 0;
+        maxEvents = max(maxEvents, sample.events);
+
+        const auto threadLastEvent = sample.lastEventNanoseconds > 0 ? sample.lastEventNanoseconds : start;
+        summary.threadTailIdle.push_back(ToSeconds(lastEvent - threadLastEvent));
+    }
+    summary.eventsRateAverage = elapsed > 0 ? double(summary.total.events) / elapsed : 0;
+
+    // 1 when balanced, 2 when the busiest thread did twice the mean, idle threads show up as a larger ratio
+    const double meanEvents = samples.empty() ? 0 : double(summary.total.events) / double(samples.size());
+    summary.imbalance = meanEvents > 0 ? double(maxEvents) / meanEvents : 1;
+    return summary;
+}
+
+void Metrics::WriteJson(const vector<ThreadSample> &samples, const Summary &summary, double elapsed, double progress,
+                        double eta, bool final) {
+    const auto timestamp = chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count();
+
+    ostringstream line;
+    line.precision(10);
+    line << "{\"timestamp\": " << to_string(timestamp)
+         << ", \"run\": " << run
+         << ", \"final\": " << (final ? "true" : "false")
+         << ", \"elapsed_s\": " << elapsed
+         << ", \"events\": " << summary.total.events
+         << ", \"events_per_s\": " << summary.eventsRate
+         << ", \"events_per_s_average\": " << summary.eventsRateAverage
+         << ", \"steps\": " << summary.total.steps
+         << ", \"steps_per_s\": " << summary.stepsRate
+         << ", \"hits\": {";
+    for (size_t j = 0; j < outputParticlesN; j++) {
+        line << (j > 0 ? ", " : "") << "\"" << GetOutputParticleName(outputParticlesAll[j]) << "\": " << summary.total.hits[j];
+    }
+    line << "}"
+         << ", \"lock_wait_s\": " << ToSeconds(summary.total.lockWaitNanoseconds)
+         << ", \"progress\": " << progress
+         << ", \"eta_s\": ";
+    if (isnan(eta)) {
+        line << "null";
+    } else {
+        line << eta;
+    }
+    line << ", \"imbalance\": " << summary.imbalance
+         << ", \"threads\": [";
+    for (size_t i = 0; i < samples.size(); i++) {
+        line << (i > 0 ? ", " : "")
+             << "{\"events\": " << samples[i].events
+             << ", \"events_per_s\": " << summary.threadRates[i]
+             << ", \"steps\": " << samples[i].steps
+             << ", \"lock_wait_s\": " << ToSeconds(samples[i].lockWaitNanoseconds);
+        if (final) {
+            line << ", \"tail_idle_s\": " << summary.threadTailIdle[i];
+        }
+        line << "}";
+    }
+    line << "]}";
+
+    jsonFile << line.str() << endl;
+}
+
+void Metrics::WritePrometheus(const vector<ThreadSample> &samples, const Summary &summary, double elapsed,
+                              double progress, double eta) {
+    const auto runLabel = "run=\"" + to_string(run) + "\"";
+
+    ostringstream text;
+    text.precision(10);
+    const auto metric = [&](const string &name, const string &type, const string &help) {
+        text << "# HELP radiation_transmission_" << name << " " << help << "\n"
+             << "# TYPE radiation_transmission_" << name << " " << type << "\n";
+    };
+    const auto value = [&](const string &name, const string &labels, double value) {
+        text << "radiation_transmission_" << name << "{" << runLabel << labels << "} ";
+        if (isnan(value)) {
+            text << "NaN";
+        } else {
+            text << value;
+        }
+        text << "\n";
+    };
+
+    metric("elapsed_seconds", "gauge", "Time since the start of the run");
+    value("elapsed_seconds", "", elapsed);
+    metric("events_total", "counter", "Events processed in the run");
+    value("events_total", "", double(summary.total.events));
+    metric("events_per_second", "gauge", "Events processed per second since the previous sample");
+    value("events_per_second", "", summary.eventsRate);
+    metric("events_per_second_average", "gauge", "Events processed per second since the start of the run");
+    value("events_per_second_average", "", summary.eventsRateAverage);
+    metric("steps_total", "counter", "Steps tracked in the run");
+    value("steps_total", "", double(summary.total.steps));
+    metric("hits_total", "counter", "Particles reaching the detector in the run");
+    for (size_t j = 0; j < outputParticlesN; j++) {
+        value("hits_total", ",particle=\"" + GetOutputParticleName(outputParticlesAll[j]) + "\"", double(summary.total.hits[j]));
+    }
+    metric("lock_wait_seconds_total", "counter", "Time spent by the threads waiting on locks");
+    value("lock_wait_seconds_total", "", ToSeconds(summary.total.lockWaitNanoseconds));
+    metric("progress_ratio", "gauge", "Fraction of the requested primaries / secondaries done");
+    value("progress_ratio", "", progress);
+    metric("eta_seconds", "gauge", "Estimated time to the end of the run");
+    value("eta_seconds", "", eta);
+    metric("imbalance_ratio", "gauge", "Events of the busiest thread over the mean events per thread");
+    value("imbalance_ratio", "", summary.imbalance);
+    metric("thread_events_total", "counter", "Events processed by each thread in the run");
+    for (size_t i = 0; i < samples.size(); i++) {
+        value("thread_events_total", ",thread=\"" + to_string(i) + "\"", double(samples[i].events));
+    }
+    metric("thread_events_per_second", "gauge", "Events processed per second by each thread since the previous sample");
+    for (size_t i = 0; i < samples.size(); i++) {
+        value("thread_events_per_second", ",thread=\"" + to_string(i) + "\"", summary.threadRates[i]);
+    }
+    metric("thread_lock_wait_seconds_total", "counter", "Time spent by each thread waiting on locks");
+    for (size_t i = 0; i < samples.size(); i++) {
+        value("thread_lock_wait_seconds_total", ",thread=\"" + to_string(i) + "\"",
+              ToSeconds(samples[i].lockWaitNanoseconds));
+    }
+
+    metric("thread_tail_idle_seconds", "gauge",
+           "Time between the last event of each thread and the last event of any thread, the idle tail of each thread once the run is over");
+    for (size_t i = 0; i < samples.size(); i++) {
+        value("thread_tail_idle_seconds", ",thread=\"" + to_string(i) + "\"", summary.threadTailIdle[i]);
+    }
+
+    // replaced atomically, a scraper never reads a partial file
+    const auto temporaryFilename = filename + ".tmp";
+    {
+        ofstream file(temporaryFilename, ios::trunc);
+        if (!file) {
+            throw runtime_error("could not create " + temporaryFilename);
+        }
+        file << text.str();
+    }
+    filesystem::rename(temporaryFilename, filename);
+}
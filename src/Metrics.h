@@ -0,0 +1,152 @@
+
+#pragma once
+
+#include <G4Threading.hh>
+
+#include "OutputHistograms.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Live metrics of the event loop, replacing the progress printout.
+// Every thread counts its events, hits per species, steps and time spent waiting on locks in its own cache line, with
+// plain relaxed stores (each counter has a single writer). A reporter thread reads them at a fixed interval, never
+// blocking the event loop, prints the progress and optionally writes JSON lines (one sample per line) or a Prometheus text file.
+// The end of the last event of each thread gives its tail idle time: how long it waited for the others at the end of the
+// event loop, the cost of dealing the events in batches that are too large for events of very different costs
+class Metrics {
+public:
+    enum class Format {
+        json,
+        prometheus,
+    };
+
+    // metrics are written to 'filename' every 'interval' seconds, the progress is always printed
+    static void Configure(const std::string &filename, Format format, double interval);
+
+    static void Start(unsigned int run); // master, before the event loop
+
+    static void Stop(); // master, after the event loop, writes the final sample
+
+    static void CountEvent() {
+        auto &threadCounters = GetThreadCounters();
+        Increment(threadCounters.events);
+        threadCounters.lastEventNanoseconds.store(Now(), std::memory_order_relaxed);
+    }
+
+    static void CountHit(OutputParticle particle) {
+        Increment(GetThreadCounters().hits[ToIndex(particle)]);
+    }
+
+    static void CountStep() {
+        Increment(GetThreadCounters().steps);
+    }
+
+    // acquires the lock, the time spent waiting for it is accounted to the calling thread
+    template<typename Mutex>
+    static std::unique_lock<Mutex> Lock(Mutex &mutex) {
+        std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            const auto start = std::chrono::steady_clock::now();
+            lock.lock();
+            const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start);
+            Increment(GetThreadCounters().lockWaitNanoseconds, wait.count());
+        }
+        return lock;
+    }
+
+    // tail idle time of each thread (in s), summed over the runs so far
+    static std::vector<double> GetTailIdle();
+
+private:
+    struct alignas(64) ThreadCounters {
+        std::atomic<unsigned long long> events = 0;
+        std::atomic<unsigned long long> steps = 0;
+        std::atomic<unsigned long long> lockWaitNanoseconds = 0;
+        std::atomic<long long> lastEventNanoseconds = 0; // end of the last event of the run, 0 before the first one
+        std::array<std::atomic<unsigned long long>, outputParticlesN> hits = {};
+    };
+
+    // copy of the counters of one thread, taken by the reporter
+    struct ThreadSample {
+        unsigned long long events = 0;
+        unsigned long long steps = 0;
+        unsigned long long lockWaitNanoseconds = 0;
+        long long lastEventNanoseconds = 0;
+        std::array<unsigned long long, outputParticlesN> hits = {};
+    };
+
+    // totals and throughputs of a sample, the rates are computed against the previous sample
+    struct Summary {
+        ThreadSample total;
+        double eventsRate = 0;
+        double eventsRateAverage = 0;
+        double stepsRate = 0;
+        double imbalance = 1;
+        std::vector<double> threadRates;
+        // time between the last event of each thread and the last event of any thread, the whole event loop so far
+        // for a thread without events
+        std::vector<double> threadTailIdle;
+    };
+
+    static void Increment(std::atomic<unsigned long long> &counter, unsigned long long value = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static long long Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static ThreadCounters &GetThreadCounters() {
+        return threadCounters != nullptr ? *threadCounters : RegisterThread();
+    }
+
+    static ThreadCounters &RegisterThread();
+
+    static std::vector<ThreadSample> Sample();
+
+    static void ReporterLoop();
+
+    static void Report(bool final);
+
+    static Summary Summarize(const std::vector<ThreadSample> &samples, double elapsed, double sampleInterval);
+
+    static void WriteJson(const std::vector<ThreadSample> &samples, const Summary &summary, double elapsed,
+                          double progress, double eta, bool final);
+
+    static void WritePrometheus(const std::vector<ThreadSample> &samples, const Summary &summary, double elapsed,
+                                double progress, double eta);
+
+    static std::string filename;
+    static Format format;
+    static double interval;
+    static std::ofstream jsonFile; // kept open across runs, one line per sample
+
+    static unsigned int run;
+    static std::chrono::steady_clock::time_point runStart;
+
+    // previous sample, for the instantaneous throughputs
+    static std::chrono::steady_clock::time_point lastTime;
+    static std::vector<ThreadSample> lastSamples;
+
+    static std::vector<double> tailIdle; // per thread, summed over the runs
+
+    static std::mutex countersMutex; // only taken when a thread registers and by the reporter
+    static std::vector<std::unique_ptr<ThreadCounters>> counters;
+    static G4ThreadLocal ThreadCounters *threadCounters;
+
+    static std::thread reporter;
+    static std::mutex reporterMutex;
+    static std::condition_variable reporterCondition;
+    static bool reporterStop;
+};
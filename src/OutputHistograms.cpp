@@ -0,0 +1,205 @@
+
+#include "OutputHistograms.h"
+
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+// title of each output particle
+constexpr array<const char *, outputParticlesN> outputParticleTitles = {
+        "Negative Muon", "Positive Muon", "Electron", "Positron", "Gamma", "Proton", "Neutron"};
+
+string GetFamilyTitle(InputParticle family) {
+    auto title = GetInputParticleName(family);
+    title[0] = (char) toupper(title[0]);
+    return title;
+}
+
+bool IsFamilySplit(InputParticle family) {
+    return family == InputParticle::muon || family == InputParticle::electron;
+}
+} // namespace
+
+OutputHistograms::OutputHistograms() {
+    const auto binsEnergyN = LogBinnedHistograms::energyBinsN;
+    const auto binsEnergy = LogBinnedHistograms::GetEnergyEdges().data();
+    const auto binsZenithN = LogBinnedHistograms::zenithBinsN;
+    const auto binsZenithMin = LogBinnedHistograms::zenithMin;
+    const auto binsZenithMax = LogBinnedHistograms::zenithMax;
+
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        const auto family = GetOutputParticleFamily(particle);
+        // particles that are not split use the family name directly (e.g. 'gamma_energy')
+        const string name = IsFamilySplit(family) ? GetOutputParticleName(particle) : GetInputParticleName(family);
+        const string title = outputParticleTitles[index];
+
+        energyHists[index] = new TH1D((name + "_energy").c_str(), (title + " Kinetic Energy (MeV)").c_str(),
+                                      binsEnergyN, binsEnergy);
+        energyHists[index]->GetXaxis()->SetTitle("Energy (MeV)");
+        energyHists[index]->GetYaxis()->SetTitle("Counts / s / m2");
+
+        zenithHists[index] = new TH1D((name + "_zenith").c_str(), (title + " Zenith Angle (degrees)").c_str(),
+                                      binsZenithN, binsZenithMin, binsZenithMax);
+        zenithHists[index]->GetXaxis()->SetTitle("Zenith Angle (degrees)");
+        zenithHists[index]->GetYaxis()->SetTitle("Counts / s / m2");
+
+        energyZenithHists[index] = new TH2D((name + "_energy_zenith").c_str(),
+                                            (title + " Kinetic Energy (MeV) vs Zenith Angle (degrees)").c_str(),
+                                            binsEnergyN, binsEnergy, binsZenithN, binsZenithMin, binsZenithMax);
+        energyZenithHists[index]->GetXaxis()->SetTitle("Energy (MeV)");
+        energyZenithHists[index]->GetYaxis()->SetTitle("Zenith Angle (degrees)");
+        energyZenithHists[index]->GetZaxis()->SetTitle("Counts / s / m2");
+    }
+}
+
+OutputHistograms::~OutputHistograms() {
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        delete energyHists[index];
+        delete zenithHists[index];
+        delete energyZenithHists[index];
+    }
+}
+
+void OutputHistograms::Flush() const {
+    if (!hits) {
+        return;
+    }
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        hits->AddTo(index, *energyHists[index], *zenithHists[index], *energyZenithHists[index]);
+    }
+}
+
+void OutputHistograms::Add(const OutputHistograms &other) {
+    Flush();
+    other.Flush();
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        energyHists[index]->Add(other.energyHists[index]);
+        zenithHists[index]->Add(other.zenithHists[index]);
+        energyZenithHists[index]->Add(other.energyZenithHists[index]);
+    }
+}
+
+void OutputHistograms::Reset() {
+    if (hits) {
+        hits->Clear();
+    }
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        energyHists[index]->Reset();
+        zenithHists[index]->Reset();
+        energyZenithHists[index]->Reset();
+    }
+}
+
+void OutputHistograms::Scale(InputParticle family, double energyFactor, double zenithFactor,
+                             double energyZenithFactor) {
+    Flush();
+    for (const auto particle: outputParticlesAll) {
+        if (GetOutputParticleFamily(particle) != family) {
+            continue;
+        }
+        const auto index = ToIndex(particle);
+        energyHists[index]->Scale(energyFactor);
+        zenithHists[index]->Scale(zenithFactor);
+        energyZenithHists[index]->Scale(energyZenithFactor);
+    }
+}
+
+double OutputHistograms::GetIntegral() const {
+    Flush();
+    double integral = 0;
+    for (const auto hist: energyZenithHists) {
+        integral += hist->Integral();
+    }
+    return integral;
+}
+
+double OutputHistograms::GetIntegral(InputParticle family) const {
+    Flush();
+    double integral = 0;
+    for (const auto particle: outputParticlesAll) {
+        if (GetOutputParticleFamily(particle) == family) {
+            integral += energyZenithHists[ToIndex(particle)]->Integral();
+        }
+    }
+    return integral;
+}
+
+void OutputHistograms::Write(TDirectory *directory) const {
+    Flush();
+    directory->cd();
+
+    for (const auto family: {InputParticle::muon, InputParticle::electron, InputParticle::gamma,
+                             InputParticle::proton, InputParticle::neutron}) {
+        if (IsFamilySplit(family)) {
+            // combined histograms, with the same names and contents as before the split
+            const auto name = GetInputParticleName(family);
+            const auto title = GetFamilyTitle(family);
+            unique_ptr<TH1D> familyEnergy, familyZenith;
+            unique_ptr<TH2D> familyEnergyZenith;
+            for (const auto particle: outputParticlesAll) {
+                if (GetOutputParticleFamily(particle) != family) {
+                    continue;
+                }
+                const auto index = ToIndex(particle);
+                if (!familyEnergy) {
+                    familyEnergy.reset((TH1D *) energyHists[index]->Clone((name + "_energy").c_str()));
+                    familyEnergy->SetTitle((title + " Kinetic Energy (MeV)").c_str());
+                    familyZenith.reset((TH1D *) zenithHists[index]->Clone((name + "_zenith").c_str()));
+                    familyZenith->SetTitle((title + " Zenith Angle (degrees)").c_str());
+                    familyEnergyZenith.reset(
+                            (TH2D *) energyZenithHists[index]->Clone((name + "_energy_zenith").c_str()));
+                    familyEnergyZenith->SetTitle((title + " Kinetic Energy (MeV) vs Zenith Angle (degrees)").c_str());
+                } else {
+                    familyEnergy->Add(energyHists[index]);
+                    familyZenith->Add(zenithHists[index]);
+                    familyEnergyZenith->Add(energyZenithHists[index]);
+                }
+            }
+            familyEnergy->Write();
+            familyZenith->Write();
+            familyEnergyZenith->Write();
+        }
+
+        for (const auto particle: outputParticlesAll) {
+            if (GetOutputParticleFamily(particle) == family) {
+                energyHists[ToIndex(particle)]->Write();
+                zenithHists[ToIndex(particle)]->Write();
+                energyZenithHists[ToIndex(particle)]->Write();
+            }
+        }
+    }
+}
+
+void OutputHistograms::WriteRaw(TDirectory *directory) const {
+    Flush();
+    directory->cd();
+
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        energyHists[index]->Write();
+        zenithHists[index]->Write();
+        energyZenithHists[index]->Write();
+    }
+}
+
+void OutputHistograms::AddFromDirectory(TDirectory *directory) {
+    for (const auto particle: outputParticlesAll) {
+        const auto index = ToIndex(particle);
+        for (TH1 *hist: {(TH1 *) energyHists[index], (TH1 *) zenithHists[index], (TH1 *) energyZenithHists[index]}) {
+            // histograms are not attached to the directory (TH1::AddDirectory(false)), we own the copy
+            const auto other = unique_ptr<TH1>(directory->Get<TH1>(hist->GetName()));
+            if (!other) {
+                throw runtime_error("OutputHistograms::AddFromDirectory: histogram " + string(hist->GetName()) +
+                                    " not found in " + directory->GetName());
+            }
+            hist->Add(other.get());
+        }
+    }
+}
@@ -0,0 +1,103 @@
+
+#pragma once
+
+#include <TDirectory.h>
+#include <TH1D.h>
+#include <TH2D.h>
+
+#include "InputParticle.h"
+#include "LogBinnedHistograms.h"
+
+#include <array>
+#include <memory>
+#include <string>
+
+// Species of the particles reaching the detector, each one is scored in its own set of histograms.
+// Charge conjugates are kept apart and combined only when writing the output
+enum class OutputParticle : unsigned int {
+    muonMinus,
+    muonPlus,
+    electron,
+    positron,
+    gamma,
+    proton,
+    neutron,
+};
+
+constexpr std::size_t outputParticlesN = 7;
+
+constexpr std::array<OutputParticle, outputParticlesN> outputParticlesAll = {
+        OutputParticle::muonMinus, OutputParticle::muonPlus, OutputParticle::electron, OutputParticle::positron,
+        OutputParticle::gamma, OutputParticle::proton, OutputParticle::neutron};
+
+constexpr std::size_t ToIndex(OutputParticle particle) {
+    return static_cast<std::size_t>(particle);
+}
+
+// e.g. "mu_minus", also the name of the histograms of the split charge conjugates
+inline std::string GetOutputParticleName(OutputParticle particle) {
+    constexpr std::array<const char *, outputParticlesN> names = {
+            "mu_minus", "mu_plus", "e_minus", "e_plus", "gamma", "proton", "neutron"};
+    return names[ToIndex(particle)];
+}
+
+// input species whose normalisation applies to this output particle, also the name of the combined output histograms
+constexpr InputParticle GetOutputParticleFamily(OutputParticle particle) {
+    constexpr std::array<InputParticle, outputParticlesN> families = {
+            InputParticle::muon, InputParticle::muon, InputParticle::electron, InputParticle::electron,
+            InputParticle::gamma, InputParticle::proton, InputParticle::neutron};
+    return families[ToIndex(particle)];
+}
+
+// Energy / zenith histograms of the particles reaching the detector.
+// Each thread fills its own detached instance, which is merged into the master instance at the end of the run. The hits
+// are binned in batches (see LogBinnedHistograms) and only added to the ROOT histograms when they are read through the
+// methods below
+class OutputHistograms {
+public:
+    OutputHistograms();
+
+    ~OutputHistograms();
+
+    OutputHistograms(const OutputHistograms &) = delete;
+
+    OutputHistograms &operator=(const OutputHistograms &) = delete;
+
+    // the zenith is given by its cosine, the angle is only computed when the hit is binned
+    void Fill(OutputParticle particle, double energy, double cosZenith, double weight = 1) {
+        if (!hits) {
+            hits = std::make_unique<LogBinnedHistograms>(outputParticlesN);
+        }
+        hits->Fill(ToIndex(particle), energy, cosZenith, weight);
+    }
+
+    void Add(const OutputHistograms &other);
+
+    void Reset();
+
+    // scale all the output particles normalised to the given input particle
+    void Scale(InputParticle family, double energyFactor, double zenithFactor, double energyZenithFactor);
+
+    double GetIntegral() const;
+
+    double GetIntegral(InputParticle family) const;
+
+    // writes the histograms of each input particle family (e.g. 'muon_energy') and the split charge conjugates of
+    // the families that have them (e.g. 'mu_minus_energy', 'mu_plus_energy')
+    void Write(TDirectory *directory) const;
+
+    // unnormalised per-particle histograms only, in a format that can be added back with 'AddFromDirectory'
+    void WriteRaw(TDirectory *directory) const;
+
+    void AddFromDirectory(TDirectory *directory);
+
+    std::array<TH1D *, outputParticlesN> energyHists{};
+    std::array<TH1D *, outputParticlesN> zenithHists{};
+    std::array<TH2D *, outputParticlesN> energyZenithHists{};
+
+private:
+    // adds the hits filled so far to the ROOT histograms, which are otherwise unchanged: only logically const
+    void Flush() const;
+
+    mutable std::unique_ptr<LogBinnedHistograms> hits; // created by the first Fill
+};
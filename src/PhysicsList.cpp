@@ -3,35 +3,62 @@
 
 #include <G4DecayPhysics.hh>
 #include <G4EmExtraPhysics.hh>
+#include <G4EmLivermorePhysics.hh>
 #include <G4EmStandardPhysics.hh>
-#include <G4EmStandardPhysics_option4.hh>
 #include <G4HadronElasticPhysics.hh>
+#include <G4HadronElasticPhysicsHP.hh>
 #include <G4HadronPhysicsFTFP_BERT.hh>
+#include <G4HadronPhysicsQGSP_BIC_HP.hh>
+#include <G4IonBinaryCascadePhysics.hh>
 #include <G4IonPhysics.hh>
 #include <G4NeutronTrackingCut.hh>
 #include <G4RadioactiveDecayPhysics.hh>
 #include <G4StoppingPhysics.hh>
-#include <G4VModularPhysicsList.hh>
-#include <G4EmLivermorePhysics.hh>
-#include <G4EmLivermorePolarizedPhysics.hh>
-#include <G4EmPenelopePhysics.hh>
-#include <G4HadronElasticPhysicsHP.hh>
-#include <G4IonBinaryCascadePhysics.hh>
-#include <G4HadronPhysicsQGSP_BIC_HP.hh>
 
-PhysicsList::PhysicsList() : G4VModularPhysicsList() {
+using namespace std;
+
+PhysicsList::PhysicsList(const string &preset, optional<bool> radioactiveDecay, optional<bool> emExtra)
+        : G4VModularPhysicsList() {
     SetVerboseLevel(1);
 
+    if (GetPresets().count(preset) == 0) {
+        throw runtime_error("PhysicsList::PhysicsList: unknown physics preset " + preset);
+    }
+
     RegisterPhysics(new G4DecayPhysics());
-    RegisterPhysics(new G4RadioactiveDecayPhysics());
-    RegisterPhysics(new G4EmExtraPhysics());
-    RegisterPhysics(new G4EmLivermorePhysics());
-    RegisterPhysics(new G4IonBinaryCascadePhysics());
-    RegisterPhysics(new G4HadronPhysicsQGSP_BIC_HP());
-    RegisterPhysics(new G4HadronElasticPhysicsHP());
-    // RegisterPhysics(new G4StoppingPhysics());
-    RegisterPhysics(new G4IonPhysics());
-
-    // Neutron tracking cut
-    RegisterPhysics(new G4NeutronTrackingCut());
+
+    if (preset == "QGSP_BIC_HP_LIV") {
+        RegisterPhysics(new G4EmLivermorePhysics());
+        RegisterPhysics(new G4IonBinaryCascadePhysics());
+        RegisterPhysics(new G4HadronPhysicsQGSP_BIC_HP());
+        RegisterPhysics(new G4HadronElasticPhysicsHP());
+        RegisterPhysics(new G4IonPhysics());
+    } else if (preset == "FTFP_BERT") {
+        RegisterPhysics(new G4EmStandardPhysics());
+        RegisterPhysics(new G4HadronPhysicsFTFP_BERT());
+        RegisterPhysics(new G4HadronElasticPhysics());
+        RegisterPhysics(new G4StoppingPhysics());
+        RegisterPhysics(new G4IonPhysics());
+    } else {
+        RegisterPhysics(new G4EmStandardPhysics());
+    }
+
+    const bool withHadrons = preset != "EM";
+    const bool withRadioactiveDecay = radioactiveDecay.value_or(preset == "QGSP_BIC_HP_LIV");
+    const bool withEmExtra = emExtra.value_or(withHadrons);
+
+    if (withRadioactiveDecay) {
+        RegisterPhysics(new G4RadioactiveDecayPhysics());
+    }
+    if (withEmExtra) {
+        RegisterPhysics(new G4EmExtraPhysics());
+    }
+
+    if (withHadrons) {
+        // Neutron tracking cut
+        RegisterPhysics(new G4NeutronTrackingCut());
+    }
+
+    description = preset + " (radioactive decay: " + (withRadioactiveDecay ? "on" : "off") + ", EM extra: " +
+                  (withEmExtra ? "on" : "off") + ")";
 }
@@ -1,22 +1,26 @@
-
 #pragma once
 
-#include <G4DecayPhysics.hh>
-#include <G4EmExtraPhysics.hh>
-#include <G4EmStandardPhysics.hh>
-#include <G4EmStandardPhysics_option4.hh>
-#include <G4HadronElasticPhysics.hh>
-#include <G4HadronPhysicsFTFP_BERT.hh>
-#include <G4IonPhysics.hh>
-#include <G4NeutronTrackingCut.hh>
-#include <G4RadioactiveDecayPhysics.hh>
-#include <G4StoppingPhysics.hh>
 #include <G4VModularPhysicsList.hh>
 
-
+#include <optional>
+#include <set>
+#include <string>
 
 class PhysicsList : public G4VModularPhysicsList {
 public:
-    PhysicsList();
-};
+    // presets, from the most accurate to the fastest:
+    //  - QGSP_BIC_HP_LIV: QGSP_BIC_HP hadronics with high precision neutrons and Livermore EM
+    //  - FTFP_BERT: FTFP_BERT hadronics with standard EM (option 0)
+    //  - EM: standard EM (option 0) and decays only
+    // radioactive decay and extra EM (gamma / lepto nuclear) physics follow the preset unless set explicitly
+    explicit PhysicsList(const std::string &preset = "QGSP_BIC_HP_LIV", std::optional<bool> radioactiveDecay = {},
+                         std::optional<bool> emExtra = {});
 
+    static std::set<std::string> GetPresets() { return {"QGSP_BIC_HP_LIV", "FTFP_BERT", "EM"}; }
+
+    // e.g. "QGSP_BIC_HP_LIV (radioactive decay: on, EM extra: on)", stored in the output file
+    const std::string &GetDescription() const { return description; }
+
+private:
+    std::string description;
+};
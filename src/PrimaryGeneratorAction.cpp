@@ -1,6 +1,7 @@
 
 #include "PrimaryGeneratorAction.h"
 #include "RunAction.h"
+#include "HitRecorder.h"
 
 #include <G4Event.hh>
 #include <G4ParticleTable.hh>
@@ -16,13 +17,11 @@ PrimaryGeneratorAction::PrimaryGeneratorAction() : G4VUserPrimaryGeneratorAction
 }
 
 void PrimaryGeneratorAction::GeneratePrimaries(G4Event *event) {
-    const auto particleName = RunAction::ChooseParticle();
+    const auto inputParticle = RunAction::ChooseParticle();
 
-    G4ParticleDefinition *particle = G4ParticleTable::GetParticleTable()->FindParticle(
-            RunAction::GetGeant4ParticleName(particleName));
-    gun.SetParticleDefinition(particle);
+    gun.SetParticleDefinition(RunAction::GetInputParticleDefinition(inputParticle));
 
-    const auto [energy, zenith] = RunAction::GenerateEnergyAndZenith(particleName);
+    const auto [energy, zenith] = RunAction::GenerateEnergyAndZenith(inputParticle);
 
     gun.SetParticleEnergy(energy);
 
@@ -36,5 +35,9 @@ void PrimaryGeneratorAction::GeneratePrimaries(G4Event *event) {
 
     gun.GeneratePrimaryVertex(event);
 
-    RunAction::IncreaseLaunchedPrimaries(particleName);
+    RunAction::SetEventPrimary(inputParticle); // accounted for at the end of the event
+
+    if (HitRecorder::IsEnabled()) {
+        HitRecorder::SetEventPrimary(event->GetEventID(), inputParticle, energy, zenith);
+    }
 }
@@ -0,0 +1,14 @@
+
+#pragma once
+
+#include <cstdint>
+
+// Derives statistically independent seeds from a base seed, e.g. one per resumed run segment.
+// SplitMix64 finaliser, consecutive streams give unrelated seeds
+inline long DeriveSeed(long seed, std::uint64_t stream) {
+    std::uint64_t z = (std::uint64_t) seed + (stream + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (long) (z >> 1); // positive, as expected by the Geant4 engines
+}
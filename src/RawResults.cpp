@@ -0,0 +1,71 @@
+#include "RawResults.h"
+
+#include <TList.h>
+#include <TParameter.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+string GetLaunchedPrimariesKey(InputParticle particle) {
+    return "launched_" + GetInputParticleName(particle);
+}
+
+unsigned long long GetParameter(TDirectory *directory, const string &key) {
+    const auto parameter = unique_ptr<TParameter<Long64_t>>(directory->Get<TParameter<Long64_t>>(key.c_str()));
+    if (!parameter) {
+        throw runtime_error("RawResults: " + key + " not found in " + directory->GetName());
+    }
+    return parameter->GetVal();
+}
+} // namespace
+
+void RawResults::Add(const RawResults &other) {
+    histograms->Add(*other.histograms);
+    for (const auto particle: inputParticlesAll) {
+        launchedPrimaries[ToIndex(particle)] += other.launchedPrimaries[ToIndex(particle)];
+    }
+    secondaries += other.secondaries;
+}
+
+unsigned long long RawResults::GetLaunchedPrimaries() const {
+    unsigned long long count = 0;
+    for (const auto launched: launchedPrimaries) {
+        count += launched;
+    }
+    return count;
+}
+
+void RawResults::Write(TDirectory *directory) const {
+    histograms->WriteRaw(directory);
+
+    directory->cd();
+    for (const auto particle: inputParticlesAll) {
+        TParameter<Long64_t>(GetLaunchedPrimariesKey(particle).c_str(),
+                             (Long64_t) launchedPrimaries[ToIndex(particle)]).Write();
+    }
+    TParameter<Long64_t>("secondaries", (Long64_t) secondaries).Write();
+}
+
+void RawResults::AddFromDirectory(TDirectory *directory) {
+    histograms->AddFromDirectory(directory);
+    for (const auto particle: inputParticlesAll) {
+        launchedPrimaries[ToIndex(particle)] += GetParameter(directory, GetLaunchedPrimariesKey(particle));
+    }
+    secondaries += GetParameter(directory, "secondaries");
+}
+
+bool RawResults::IsStoredIn(TDirectory *directory) {
+    return directory->GetListOfKeys()->FindObject(GetLaunchedPrimariesKey(InputParticle::neutron).c_str()) != nullptr;
+}
+
+void RawResults::Normalize(InputParticle particle, const TH2D &inputEnergyZenith, const TH1D &inputEnergy,
+                           const TH1D &inputZenith) {
+    const double launched = launchedPrimaries[ToIndex(particle)];
+    if (launched == 0) {
+        return;
+    }
+    histograms->Scale(particle, inputEnergy.Integral() / launched, inputZenith.Integral() / launched,
+                      inputEnergyZenith.Integral() / launched);
+}
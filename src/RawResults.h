@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include <TDirectory.h>
+#include <TH1D.h>
+#include <TH2D.h>
+
+#include "InputParticle.h"
+#include "OutputHistograms.h"
+
+#include <array>
+#include <memory>
+
+// Unnormalised results: raw counts and the number of primaries launched per input particle.
+// Checkpoints and shards are stored in this format so that they can be added up and normalised once at the end
+struct RawResults {
+    std::unique_ptr<OutputHistograms> histograms = std::make_unique<OutputHistograms>();
+    std::array<unsigned long long, inputParticlesN> launchedPrimaries{};
+    unsigned long long secondaries = 0;
+
+    void Add(const RawResults &other);
+
+    unsigned long long GetLaunchedPrimaries() const;
+
+    void Write(TDirectory *directory) const;
+
+    // throws if the directory does not contain raw results
+    void AddFromDirectory(TDirectory *directory);
+
+    static bool IsStoredIn(TDirectory *directory);
+
+    // scales the histograms of the given input particle to a flux: integral of the input distributions divided by
+    // the number of launched primaries. Must be called once, after all the results have been added
+    void Normalize(InputParticle particle, const TH2D &inputEnergyZenith, const TH1D &inputEnergy,
+                   const TH1D &inputZenith);
+};
@@ -0,0 +1,209 @@
+
+#include "ResponseMatrix.h"
+
+#include <TAxis.h>
+
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+vector<double> GetEdges(const TAxis &axis) {
+    vector<double> edges;
+    for (int i = 1; i <= axis.GetNbins() + 1; ++i) {
+        edges.push_back(axis.GetBinLowEdge(i));
+    }
+    return edges;
+}
+} // namespace
+
+bool ResponseMatrix::enabled = false;
+ResponseMatrix::Sampling ResponseMatrix::sampling = ResponseMatrix::Sampling::linear;
+ResponseMatrix::Grid ResponseMatrix::grid = ResponseMatrix::Grid::output;
+
+array<ResponseMatrix::Binning, inputParticlesN> ResponseMatrix::inputBinnings = {};
+vector<double> ResponseMatrix::outputEnergyEdges = {};
+vector<double> ResponseMatrix::outputZenithEdges = {};
+
+mutex ResponseMatrix::talliesMutex;
+vector<unique_ptr<ResponseMatrix::Tallies>> ResponseMatrix::tallies = {};
+G4ThreadLocal ResponseMatrix::Tallies *ResponseMatrix::threadTallies = nullptr;
+G4ThreadLocal ResponseMatrix::Primary ResponseMatrix::threadPrimary = {};
+
+void ResponseMatrix::Enable(Sampling newSampling, Grid newGrid) {
+    enabled = true;
+    sampling = newSampling;
+    grid = newGrid;
+}
+
+void ResponseMatrix::SetInputBinning(InputParticle particle, const TH2D &inputEnergyZenith) {
+    auto &binning = inputBinnings[ToIndex(particle)];
+    binning.energyEdges = GetEdges(*inputEnergyZenith.GetXaxis());
+    binning.zenithEdges = GetEdges(*inputEnergyZenith.GetYaxis());
+    if (sampling == Sampling::log && binning.energyEdges.front() <= 0) {
+        throw runtime_error("ResponseMatrix::SetInputBinning: logarithmic sampling requires positive energies, the " +
+                            GetInputParticleName(particle) + " input starts at " +
+                            to_string(binning.energyEdges.front()));
+    }
+}
+
+void ResponseMatrix::Start() {
+    if (outputEnergyEdges.empty()) {
+        // same binning as the regular output, so that the folded results are directly comparable
+        const OutputHistograms reference;
+        outputEnergyEdges = GetEdges(*reference.energyZenithHists[0]->GetXaxis());
+        outputZenithEdges = GetEdges(*reference.energyZenithHists[0]->GetYaxis());
+    }
+
+    // the threads of a previous run are idle, their matrices start again from zero
+    lock_guard<mutex> lock(talliesMutex);
+    for (auto &threadTallies: tallies) {
+        for (auto &primaries: threadTallies->primaries) {
+            if (primaries) {
+                primaries->Reset();
+            }
+        }
+        for (auto &response: threadTallies->responses) {
+            if (response) {
+                response->Reset();
+            }
+        }
+    }
+}
+
+unique_ptr<ResponseMatrix::Tallies> ResponseMatrix::MakeTallies() {
+    auto newTallies = make_unique<Tallies>();
+    for (const auto input: inputParticlesAll) {
+        const auto &binning = inputBinnings[ToIndex(input)];
+        if (binning.energyEdges.empty()) {
+            continue;
+        }
+        const int inputEnergyBinsN = (int) binning.energyEdges.size() - 1;
+        const int inputZenithBinsN = (int) binning.zenithEdges.size() - 1;
+
+        auto &primaries = newTallies->primaries[ToIndex(input)];
+        primaries = make_unique<TH2D>(GetPrimariesName(grid, input).c_str(),
+                                      ("Primary " + GetInputParticleName(input) + "s per input bin").c_str(),
+                                      inputEnergyBinsN, binning.energyEdges.data(),
+                                      inputZenithBinsN, binning.zenithEdges.data());
+        primaries->GetXaxis()->SetTitle("Energy (MeV)");
+        primaries->GetYaxis()->SetTitle("Zenith Angle (degrees)");
+
+        for (const auto output: outputParticlesAll) {
+            auto &response = newTallies->responses[GetSlot(input, output)];
+            if (response) {
+                continue; // charge conjugates share the matrix of their family with the 'transfer' grid
+            }
+            const auto family = GetOutputParticleFamily(output);
+            const auto outputName = grid == Grid::transfer ? GetInputParticleName(family) : GetOutputParticleName(output);
+            const auto &energyEdges = grid == Grid::transfer ? inputBinnings[ToIndex(family)].energyEdges
+                                                             : outputEnergyEdges;
+            const auto &zenithEdges = grid == Grid::transfer ? inputBinnings[ToIndex(family)].zenithEdges
+                                                             : outputZenithEdges;
+            if (energyEdges.empty()) {
+                throw runtime_error("ResponseMatrix::MakeTallies: input binning of " + outputName + " not set");
+            }
+
+            const array<int, 4> bins = {inputEnergyBinsN, inputZenithBinsN, (int) energyEdges.size() - 1,
+                                        (int) zenithEdges.size() - 1};
+            const array<double, 4> minimums = {0, 0, 0, 0};
+            const array<double, 4> maximums = {1, 1, 1, 1};
+            response = make_unique<THnSparseD>(
+                    GetResponseName(grid, input, outputName).c_str(),
+                    (outputName + " reaching the detector per input " + GetInputParticleName(input) + " bin").c_str(),
+                    4, bins.data(), minimums.data(), maximums.data());
+            response->GetAxis(0)->Set(bins[0], binning.energyEdges.data());
+            response->GetAxis(0)->SetTitle("Input Energy (MeV)");
+            response->GetAxis(1)->Set(bins[1], binning.zenithEdges.data());
+            response->GetAxis(1)->SetTitle("Input Zenith Angle (degrees)");
+            response->GetAxis(2)->Set(bins[2], energyEdges.data());
+            response->GetAxis(2)->SetTitle("Energy (MeV)");
+            response->GetAxis(3)->Set(bins[3], zenithEdges.data());
+            response->GetAxis(3)->SetTitle("Zenith Angle (degrees)");
+            response->Sumw2();
+        }
+    }
+    return newTallies;
+}
+
+ResponseMatrix::Tallies &ResponseMatrix::GetThreadTallies() {
+    if (threadTallies == nullptr) {
+        lock_guard<mutex> lock(talliesMutex);
+        tallies.push_back(MakeTallies());
+        threadTallies = tallies.back().get();
+    }
+    return *threadTallies;
+}
+
+pair<double, double> ResponseMatrix::Sample(InputParticle particle, double randomBin, double randomEnergy,
+                                            double randomZenith) {
+    // every bin is equally likely, whatever its flux in the input
+    const auto &binning = inputBinnings[ToIndex(particle)];
+    const auto energyBinsN = binning.energyEdges.size() - 1;
+    const auto zenithBinsN = binning.zenithEdges.size() - 1;
+    const auto bin = min<size_t>(size_t(randomBin * double(energyBinsN * zenithBinsN)), energyBinsN * zenithBinsN - 1);
+    const auto i = bin % energyBinsN;
+    const auto j = bin / energyBinsN;
+
+    const double energyLow = binning.energyEdges[i];
+    const double energyHigh = binning.energyEdges[i + 1];
+    const double energy = sampling == Sampling::log ? energyLow * pow(energyHigh / energyLow, randomEnergy)
+                                                    : energyLow + randomEnergy * (energyHigh - energyLow);
+    const double zenith = binning.zenithEdges[j] + randomZenith * (binning.zenithEdges[j + 1] - binning.zenithEdges[j]);
+
+    threadPrimary = {particle, energy, zenith};
+    return {energy, zenith};
+}
+
+void ResponseMatrix::Fill(OutputParticle particle, double energy, double zenith, double weight) {
+    auto &response = GetThreadTallies().responses[GetSlot(threadPrimary.particle, particle)];
+    const array<double, 4> values = {threadPrimary.energy, threadPrimary.zenith, energy, zenith};
+    response->Fill(values.data(), weight);
+}
+
+void ResponseMatrix::EndOfEvent() {
+    GetThreadTallies().primaries[ToIndex(threadPrimary.particle)]->Fill(threadPrimary.energy, threadPrimary.zenith);
+}
+
+void ResponseMatrix::Write(TDirectory *directory) {
+    lock_guard<mutex> lock(talliesMutex);
+    if (tallies.empty()) {
+        return;
+    }
+
+    // all the threads are done, their matrices are added into the first one (reset at the start of the next run)
+    auto &merged = *tallies.front();
+    for (size_t t = 1; t < tallies.size(); t++) {
+        for (size_t i = 0; i < merged.primaries.size(); i++) {
+            if (merged.primaries[i]) {
+                merged.primaries[i]->Add(tallies[t]->primaries[i].get());
+            }
+        }
+        for (size_t i = 0; i < merged.responses.size(); i++) {
+            if (merged.responses[i]) {
+                merged.responses[i]->Add(tallies[t]->responses[i].get());
+            }
+        }
+    }
+
+    directory->cd();
+    for (const auto input: inputParticlesAll) {
+        const auto &primaries = merged.primaries[ToIndex(input)];
+        if (!primaries) {
+            continue;
+        }
+        primaries->Write();
+        Long64_t filledBins = 0;
+        for (size_t i = 0; i < outputParticlesN; i++) {
+            const auto &response = merged.responses[ToIndex(input) * outputParticlesN + i];
+            if (response) {
+                filledBins += response->GetNbins();
+                response->Write();
+            }
+        }
+        cout << "Response matrix of " << GetInputParticleName(input) << "s: " << (Long64_t) primaries->GetEntries()
+             << " primaries, " << filledBins << " filled bins" << endl;
+    }
+}
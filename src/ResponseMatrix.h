@@ -0,0 +1,101 @@
+
+#pragma once
+
+#include <G4Threading.hh>
+
+#include <TDirectory.h>
+#include <TH2D.h>
+#include <THnSparse.h>
+
+#include "InputParticle.h"
+#include "OutputHistograms.h"
+#include "ResponseMatrixNames.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Response-matrix mode. The slab is invariant in x / y, so what reaches the detector only depends on the species,
+// energy and zenith of the primary. Primaries are sampled evenly over the (energy, zenith) bins of the input histograms
+// instead of following the input distribution, and every hit is scored against the bin of its primary, giving the
+// transfer matrix of the detector. 'radiation-transmission-fold' turns it into the normalised output for any input
+// spectrum with the same binning, without running Geant4 again.
+// Each thread fills its own matrices, merged by the master at the end of the run
+class ResponseMatrix : public ResponseMatrixNames {
+public:
+    // the energy within an input bin is sampled uniformly ('linear', as for the regular input sampling) or uniformly
+    // in its logarithm ('log')
+    enum class Sampling {
+        linear,
+        log,
+    };
+
+    static void Enable(Sampling sampling, Grid grid = Grid::output);
+
+    static bool IsEnabled() { return enabled; }
+
+    static Grid GetGrid() { return grid; }
+
+    // binning of the input bins of a species, from its input histogram. Master, before the run. With the 'transfer'
+    // grid, the binnings of all the species are needed
+    static void SetInputBinning(InputParticle particle, const TH2D &inputEnergyZenith);
+
+    static void Start(); // master, before the event loop
+
+    // energy and zenith of the primary from uniform random numbers in [0, 1), remembered until the end of the event
+    static std::pair<double, double> Sample(InputParticle particle, double randomBin, double randomEnergy,
+                                            double randomZenith);
+
+    static void Fill(OutputParticle particle, double energy, double zenith, double weight);
+
+    static void EndOfEvent(); // the primary is counted in its input bin once its event is complete
+
+    // merges the matrices of all the threads and writes them ('response_<input>_<output>' sparse histograms with axes
+    // input energy, input zenith, output energy, output zenith, and 'response_<input>_primaries', or 'transfer_*' with
+    // the 'transfer' grid). Master, after the run
+    static void Write(TDirectory *directory);
+
+private:
+    struct Binning {
+        std::vector<double> energyEdges; // empty if the species is not simulated
+        std::vector<double> zenithEdges;
+    };
+
+    struct Tallies {
+        std::array<std::unique_ptr<TH2D>, inputParticlesN> primaries;
+        std::array<std::unique_ptr<THnSparseD>, inputParticlesN * outputParticlesN> responses; // see GetSlot
+    };
+
+    struct Primary {
+        InputParticle particle = InputParticle::neutron;
+        double energy = 0;
+        double zenith = 0;
+    };
+
+    // slot of the matrix of an input species and an output particle (or its family with the 'transfer' grid)
+    static std::size_t GetSlot(InputParticle input, OutputParticle output) {
+        return ToIndex(input) * outputParticlesN +
+               (grid == Grid::transfer ? ToIndex(GetOutputParticleFamily(output)) : ToIndex(output));
+    }
+
+    static std::unique_ptr<Tallies> MakeTallies();
+
+    static Tallies &GetThreadTallies();
+
+    static bool enabled;
+    static Sampling sampling;
+    static Grid grid;
+
+    // read-only during the run
+    static std::array<Binning, inputParticlesN> inputBinnings;
+    static std::vector<double> outputEnergyEdges;
+    static std::vector<double> outputZenithEdges;
+
+    static std::mutex talliesMutex; // only taken when a thread registers and when merging
+    static std::vector<std::unique_ptr<Tallies>> tallies;
+    static G4ThreadLocal Tallies *threadTallies;
+    static G4ThreadLocal Primary threadPrimary;
+};
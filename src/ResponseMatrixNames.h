@@ -0,0 +1,28 @@
+
+#pragma once
+
+#include "InputParticle.h"
+
+#include <string>
+
+// Names of the objects written by ResponseMatrix. Kept apart from it, without Geant4, so that the tools reading the
+// matrices (radiation-transmission-fold) use the same names as the simulation writing them
+class ResponseMatrixNames {
+public:
+    // 'output': the hits are scored per output particle with the binning of the regular output, for folding.
+    // 'transfer': the hits are scored per species family with the input binning of that family, so that the matrices of
+    // consecutive layers can be chained (see LayerStack)
+    enum class Grid {
+        output,
+        transfer,
+    };
+
+    static std::string GetPrimariesName(Grid grid, InputParticle input) {
+        return GetResponseName(grid, input, "primaries");
+    }
+
+    static std::string GetResponseName(Grid grid, InputParticle input, const std::string &output) {
+        return std::string(grid == Grid::transfer ? "transfer_" : "response_") + GetInputParticleName(input) + "_" +
+               output;
+    }
+};
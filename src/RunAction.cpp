@@ -1,60 +1,163 @@
 
 #include "RunAction.h"
+#include "AdaptiveStopping.h"
+#include "Checkpoint.h"
+#include "HitRecorder.h"
+#include "Metrics.h"
+#include "ResponseMatrix.h"
+#include "StackingAction.h"
+#include "SteppingAction.h"
+
+#include <G4ParticleTable.hh>
+#include <G4Threading.hh>
 
 #include <iostream>
 #include <TMath.h>
+#include <TParameter.h>
 #include <TSystem.h>
 #include <filesystem>
-#include <numeric>
 
 using namespace std;
 using namespace CLHEP;
 
-int RunAction::requestedPrimaries = 0;
-int RunAction::requestedSecondaries = 0;
+array<RunAction::PaddedCounter, inputParticlesN> RunAction::launchedPrimaries;
 
-map<string, double> RunAction::launchedPrimariesMap = {};
+G4ThreadLocal InputParticle RunAction::threadEventPrimary = InputParticle::neutron;
+G4ThreadLocal unsigned long long RunAction::threadEventHits = 0;
+G4ThreadLocal array<unsigned long long, inputParticlesN> RunAction::threadLaunchedPrimaries = {};
+G4ThreadLocal unsigned long long RunAction::threadSecondaries = 0;
 
 mutex RunAction::inputMutex;
 mutex RunAction::outputMutex;
 
-set<string> RunAction::inputParticleNames = {};
-map<string, double> RunAction::inputParticleWeights = {};
+JobContext RunAction::job = {};
+
+map<string, double> RunAction::inputParticleEntries = {};
 set<string> RunAction::inputParticleNamesAllowed = {"neutron", "gamma", "proton", "electron", "muon"};
 
 string RunAction::inputFilename;
-string RunAction::outputFilename;
+string RunAction::physicsDescription;
 
 TFile *RunAction::inputFile = nullptr;
-TFile *RunAction::outputFile = nullptr;
+unique_ptr<CompiledInput> RunAction::compiledInput = nullptr;
+TNamed *RunAction::inputLatitude = nullptr;
 
 map<string, tuple<TH2D *, TH1D *, TH1D *>> RunAction::inputParticleHists = {};
+array<unique_ptr<EnergyZenithSampler>, inputParticlesN> RunAction::inputParticleSamplers = {};
 
-TH1D *RunAction::muonsEnergy = nullptr;
-TH1D *RunAction::electronsEnergy = nullptr;
-TH1D *RunAction::gammasEnergy = nullptr;
-TH1D *RunAction::protonsEnergy = nullptr;
-TH1D *RunAction::neutronsEnergy = nullptr;
+OutputHistograms *RunAction::outputHistograms = nullptr;
+G4ThreadLocal OutputHistograms *RunAction::threadOutputHistograms = nullptr;
 
-TH1D *RunAction::muonsZenith = nullptr;
-TH1D *RunAction::electronsZenith = nullptr;
-TH1D *RunAction::gammasZenith = nullptr;
-TH1D *RunAction::protonsZenith = nullptr;
-TH1D *RunAction::neutronsZenith = nullptr;
+bool RunAction::albedoEnabled = false;
+OutputHistograms *RunAction::albedoHistograms = nullptr;
+G4ThreadLocal OutputHistograms *RunAction::threadAlbedoHistograms = nullptr;
 
-TH2D *RunAction::muonsEnergyZenith = nullptr;
-TH2D *RunAction::electronsEnergyZenith = nullptr;
-TH2D *RunAction::gammasEnergyZenith = nullptr;
-TH2D *RunAction::protonsEnergyZenith = nullptr;
-TH2D *RunAction::neutronsEnergyZenith = nullptr;
+atomic<unsigned long long> RunAction::secondariesCount = 0;
+
+unordered_map<const G4ParticleDefinition *, OutputParticle> RunAction::outputParticleSlots = {};
+array<G4ParticleDefinition *, inputParticlesN> RunAction::inputParticleDefinitions = {};
 
 RunAction::RunAction() : G4UserRunAction() {}
 
 void RunAction::BeginOfRunAction(const G4Run *) {
-    lock_guard<std::mutex> lock(mutex);
-
     if (IsMaster()) {
+        // the input is kept across jobs, the output file across the runs of a job (e.g. in scan mode)
+        LoadInput();
+        if (job.inputParticlesCumulativeWeights.empty()) {
+            PrepareJob();
+        }
+        if (job.outputFile == nullptr) {
+            job.outputFile = TFile::Open(job.outputFilename.c_str(), "RECREATE");
+        }
+
+        // when resuming, the counters start from the totals of the checkpoint so that the requested number of
+        // primaries / secondaries covers both segments
+        const auto resumeState = Checkpoint::GetResumeState();
+        for (const auto particle: inputParticlesAll) {
+            const auto index = ToIndex(particle);
+            launchedPrimaries[index].value = resumeState ? resumeState->launchedPrimaries[index] : 0;
+        }
+        secondariesCount = resumeState ? resumeState->secondaries : 0;
+
+        outputHistograms = new OutputHistograms();
+        if (albedoEnabled) {
+            albedoHistograms = new OutputHistograms();
+        }
+
+        const auto &detector = *dynamic_cast<const DetectorConstruction *>(
+                G4RunManager::GetRunManager()->GetUserDetectorConstruction());
+        if (StackingAction::IsRangeRejectionEnabled()) {
+            StackingAction::BeginOfRun(detector);
+        }
+        SteppingAction::BeginOfRun(detector);
+
+        if (Checkpoint::IsEnabled()) {
+            Checkpoint::Start();
+        }
+
+        AdaptiveStopping::Start();
+
+        if (ResponseMatrix::IsEnabled()) {
+            // with the 'transfer' grid every family is also an outgoing species, binned as its input
+            const auto &binnedParticleNames = ResponseMatrix::GetGrid() == ResponseMatrix::Grid::transfer
+                                              ? inputParticleNamesAllowed : job.inputParticleNames;
+            for (const auto &particleName: binnedParticleNames) {
+                ResponseMatrix::SetInputBinning(GetInputParticleFromName(particleName),
+                                                *get<0>(inputParticleHists[particleName]));
+            }
+            ResponseMatrix::Start();
+        }
+    }
+
+    threadEventHits = 0;
+    threadLaunchedPrimaries.fill(0);
+    threadSecondaries = 0;
+
+    if (!G4Threading::IsMultithreadedApplication()) {
+        // sequential mode: the master processes the events and fills the merged histograms directly
+        threadOutputHistograms = outputHistograms;
+        threadAlbedoHistograms = albedoHistograms;
+    } else if (!IsMaster()) {
+        threadOutputHistograms = new OutputHistograms();
+        if (albedoEnabled) {
+            threadAlbedoHistograms = new OutputHistograms();
+        }
+    }
+}
+
+void RunAction::LoadInput() {
+    if (!inputParticleHists.empty()) {
+        return;
+    }
+
+    // particle dispatch tables, built before the workers start so that the event loop only does lookups
+    const auto particleTable = G4ParticleTable::GetParticleTable();
+    for (const auto particle: inputParticlesAll) {
+        inputParticleDefinitions[ToIndex(particle)] = particleTable->FindParticle(
+                GetGeant4ParticleName(GetInputParticleName(particle)));
+    }
+    outputParticleSlots = {
+            {particleTable->FindParticle("mu-"), OutputParticle::muonMinus},
+            {particleTable->FindParticle("mu+"), OutputParticle::muonPlus},
+            {particleTable->FindParticle("e-"), OutputParticle::electron},
+            {particleTable->FindParticle("e+"), OutputParticle::positron},
+            {particleTable->FindParticle("gamma"), OutputParticle::gamma},
+            {particleTable->FindParticle("proton"), OutputParticle::proton},
+            {particleTable->FindParticle("neutron"), OutputParticle::neutron},
+    };
+
+    if (CompiledInput::IsCompiled(inputFilename)) {
+        // the samplers read the tables of the mapping, only the histograms written to the output are rebuilt
+        compiledInput = make_unique<CompiledInput>(inputFilename);
+        inputLatitude = new TNamed("latitude", compiledInput->GetLatitude().c_str());
+        for (const auto &particleName: inputParticleNamesAllowed) {
+            const auto particle = GetInputParticleFromName(particleName);
+            inputParticleHists[particleName] = compiledInput->MakeHistograms(particle);
+            inputParticleEntries[particleName] = compiledInput->GetEntries(particle);
+        }
+    } else {
         inputFile = TFile::Open(inputFilename.c_str(), "READ");
+        inputLatitude = inputFile->Get<TNamed>("latitude");
 
         for (const auto &particleName: inputParticleNamesAllowed) {
             inputParticleHists[particleName] = {
@@ -70,243 +173,276 @@ void RunAction::BeginOfRunAction(const G4Run *) {
             get<2>(inputParticleHists[particleName])->SetName(
                     string("input_" + particleName + "_zenith").c_str());
 
-            inputParticleWeights[particleName] = get<0>(inputParticleHists[particleName])->GetEntries();
+            inputParticleEntries[particleName] = get<0>(inputParticleHists[particleName])->GetEntries();
         }
+    }
+}
 
-        // normalize inputParticleWeights
-        double sum = 0;
-        for (const auto &particle: inputParticleNames) {
-            const auto weight = inputParticleWeights[particle];
-            sum += weight;
-        }
-        for (auto &entry: inputParticleWeights) {
-            entry.second /= sum;
+void RunAction::BuildSamplers(const set<string> &particleNames) {
+    LoadInput();
+    for (const auto &particleName: particleNames) {
+        const auto particle = GetInputParticleFromName(particleName);
+        auto &sampler = inputParticleSamplers[ToIndex(particle)];
+        if (sampler) {
+            continue;
         }
+        // the compiled samplers read the tables of the mapping
+        sampler = compiledInput ? compiledInput->MakeSampler(particle)
+                                : make_unique<EnergyZenithSampler>(*get<0>(inputParticleHists[particleName]));
+    }
+}
 
-        cout << "Particle weights:" << endl;
-        for (const auto &particleName: inputParticleNames) {
-            cout << "    - " << particleName << " relative weight: " << inputParticleWeights[particleName] << endl;
-        }
+void RunAction::PrepareJob() {
+    BuildSamplers(job.inputParticleNames);
 
-        outputFile = TFile::Open(outputFilename.c_str(), "RECREATE");
+    // normalize the weights of the selected particles
+    double sum = 0;
+    for (const auto &particleName: job.inputParticleNames) {
+        sum += inputParticleEntries[particleName];
+    }
+    for (const auto &particleName: job.inputParticleNames) {
+        job.inputParticleWeights[particleName] = inputParticleEntries[particleName] / sum;
+    }
 
-        const unsigned int binsEnergyN = 200;
-        const double binsEnergyMin = 1E-9;
-        const double binsEnergyMax = 1E8;
-        double binsEnergy[binsEnergyN + 1];
-        for (int i = 0; i <= binsEnergyN; ++i) {
-            binsEnergy[i] = TMath::Power(10, (TMath::Log10(binsEnergyMin) +
-                                              i * (TMath::Log10(binsEnergyMax) - TMath::Log10(binsEnergyMin)) /
-                                              binsEnergyN));
-        }
-        const unsigned int binsZenithN = 200;
-        const double binsZenithMin = 0;
-        const double binsZenithMax = 90;
-
-        muonsEnergy = new TH1D("muon_energy", "Muon Kinetic Energy (MeV)", binsEnergyN, binsEnergy);
-        muonsEnergy->GetXaxis()->SetTitle("Energy (MeV)");
-        muonsEnergy->GetYaxis()->SetTitle("Counts / s / m2");
-
-        electronsEnergy = new TH1D("electron_energy", "Electron Kinetic Energy (MeV)", binsEnergyN, binsEnergy);
-        electronsEnergy->GetXaxis()->SetTitle("Energy (MeV)");
-        electronsEnergy->GetYaxis()->SetTitle("Counts / s / m2");
-
-        gammasEnergy = new TH1D("gamma_energy", "Gamma Kinetic Energy (MeV)", binsEnergyN, binsEnergy);
-        gammasEnergy->GetXaxis()->SetTitle("Energy (MeV)");
-        gammasEnergy->GetYaxis()->SetTitle("Counts / s / m2");
-
-        protonsEnergy = new TH1D("proton_energy", "Proton Kinetic Energy (MeV)", binsEnergyN, binsEnergy);
-        protonsEnergy->GetXaxis()->SetTitle("Energy (MeV)");
-        protonsEnergy->GetYaxis()->SetTitle("Counts / s / m2");
-
-        neutronsEnergy = new TH1D("neutron_energy", "Neutron Kinetic Energy (MeV)", binsEnergyN, binsEnergy);
-        neutronsEnergy->GetXaxis()->SetTitle("Energy (MeV)");
-        neutronsEnergy->GetYaxis()->SetTitle("Counts / s / m2");
-
-        muonsZenith = new TH1D("muon_zenith", "Muon Zenith Angle (degrees)", binsZenithN, binsZenithMin, binsZenithMax);
-        muonsZenith->GetXaxis()->SetTitle("Zenith Angle (degrees)");
-        muonsZenith->GetYaxis()->SetTitle("Counts / s / m2");
-
-        electronsZenith = new TH1D("electron_zenith", "Electron Zenith Angle (degrees)", binsZenithN, binsZenithMin,
-                                   binsZenithMax);
-        electronsZenith->GetXaxis()->SetTitle("Zenith Angle (degrees)");
-        electronsZenith->GetYaxis()->SetTitle("Counts / s / m2");
-
-        gammasZenith = new TH1D("gamma_zenith", "Gamma Zenith Angle (degrees)", binsZenithN, binsZenithMin,
-                                binsZenithMax);
-        gammasZenith->GetXaxis()->SetTitle("Zenith Angle (degrees)");
-        gammasZenith->GetYaxis()->SetTitle("Counts / s / m2");
-
-        protonsZenith = new TH1D("proton_zenith", "Proton Zenith Angle (degrees)", binsZenithN, binsZenithMin,
-                                 binsZenithMax);
-        protonsZenith->GetXaxis()->SetTitle("Zenith Angle (degrees)");
-        protonsZenith->GetYaxis()->SetTitle("Counts / s / m2");
-
-        neutronsZenith = new TH1D("neutron_zenith", "Neutron Zenith Angle (degrees)", binsZenithN, binsZenithMin,
-                                  binsZenithMax);
-        neutronsZenith->GetXaxis()->SetTitle("Zenith Angle (degrees)");
-        neutronsZenith->GetYaxis()->SetTitle("Counts / s / m2");
-
-        muonsEnergyZenith = new TH2D("muon_energy_zenith", "Muon Kinetic Energy (MeV) vs Zenith Angle (degrees)",
-                                     binsEnergyN,
-                                     binsEnergy,
-                                     binsZenithN, binsZenithMin, binsZenithMax);
-        muonsEnergyZenith->GetXaxis()->SetTitle("Energy (MeV)");
-        muonsEnergyZenith->GetYaxis()->SetTitle("Zenith Angle (degrees)");
-        muonsEnergyZenith->GetZaxis()->SetTitle("Counts / s / m2");
-
-        electronsEnergyZenith = new TH2D("electron_energy_zenith",
-                                         "Electron Kinetic Energy (MeV) vs Zenith Angle (degrees)",
-                                         binsEnergyN,
-                                         binsEnergy, binsZenithN, binsZenithMin, binsZenithMax);
-        electronsEnergyZenith->GetXaxis()->SetTitle("Energy (MeV)");
-        electronsEnergyZenith->GetYaxis()->SetTitle("Zenith Angle (degrees)");
-        electronsEnergyZenith->GetZaxis()->SetTitle("Counts / s / m2");
-
-        gammasEnergyZenith = new TH2D("gamma_energy_zenith", "Gamma Kinetic Energy (MeV) vs Zenith Angle (degrees)",
-                                      binsEnergyN,
-                                      binsEnergy,
-                                      binsZenithN, binsZenithMin, binsZenithMax);
-        gammasEnergyZenith->GetXaxis()->SetTitle("Energy (MeV)");
-        gammasEnergyZenith->GetYaxis()->SetTitle("Zenith Angle (degrees)");
-        gammasEnergyZenith->GetZaxis()->SetTitle("Counts / s / m2");
-
-        protonsEnergyZenith = new TH2D("proton_energy_zenith", "Proton Kinetic Energy (MeV) vs Zenith Angle (degrees)",
-                                       binsEnergyN,
-                                       binsEnergy, binsZenithN, binsZenithMin, binsZenithMax);
-        protonsEnergyZenith->GetXaxis()->SetTitle("Energy (MeV)");
-        protonsEnergyZenith->GetYaxis()->SetTitle("Zenith Angle (degrees)");
-        protonsEnergyZenith->GetZaxis()->SetTitle("Counts / s / m2");
-
-        neutronsEnergyZenith = new TH2D("neutron_energy_zenith",
-                                        "Neutron Kinetic Energy (MeV) vs Zenith Angle (degrees)", binsEnergyN,
-                                        binsEnergy, binsZenithN, binsZenithMin, binsZenithMax);
-        neutronsEnergyZenith->GetXaxis()->SetTitle("Energy (MeV)");
-        neutronsEnergyZenith->GetYaxis()->SetTitle("Zenith Angle (degrees)");
-        neutronsEnergyZenith->GetZaxis()->SetTitle("Counts / s / m2");
+    cout << "Particle weights:" << endl;
+    for (const auto &particleName: job.inputParticleNames) {
+        cout << "    - " << particleName << " relative weight: " << job.inputParticleWeights[particleName] << endl;
+    }
+
+    double cumulativeWeight = 0;
+    for (const auto &particleName: job.inputParticleNames) {
+        cumulativeWeight += job.inputParticleWeights[particleName];
+        job.inputParticlesCumulativeWeights.emplace_back(GetInputParticleFromName(particleName), cumulativeWeight);
     }
 }
 
 void RunAction::EndOfRunAction(const G4Run *) {
-    if (isMaster) {
-        lock_guard<std::mutex> lockInput(inputMutex);
-        lock_guard<std::mutex> lockOutput(outputMutex);
-
-        if (launchedPrimariesMap["muon"] > 0) {
-            muonsEnergy->Scale(get<1>(inputParticleHists["muon"])->Integral() / launchedPrimariesMap.at("muon"));
-            muonsZenith->Scale(get<2>(inputParticleHists["muon"])->Integral() / launchedPrimariesMap.at("muon"));
-            muonsEnergyZenith->Scale(get<0>(inputParticleHists["muon"])->Integral() / launchedPrimariesMap.at("muon"));
-        }
-        if (launchedPrimariesMap["electron"] > 0) {
-            electronsEnergy->Scale(
-                    get<1>(inputParticleHists["electron"])->Integral() / launchedPrimariesMap.at("electron"));
-            electronsZenith->Scale(
-                    get<2>(inputParticleHists["electron"])->Integral() / launchedPrimariesMap.at("electron"));
-            electronsEnergyZenith->Scale(
-                    get<0>(inputParticleHists["electron"])->Integral() / launchedPrimariesMap.at("electron"));
-        }
-        if (launchedPrimariesMap["gamma"] > 0) {
-            gammasEnergy->Scale(get<1>(inputParticleHists["gamma"])->Integral() / launchedPrimariesMap.at("gamma"));
-            gammasZenith->Scale(get<2>(inputParticleHists["gamma"])->Integral() / launchedPrimariesMap.at("gamma"));
-            gammasEnergyZenith->Scale(
-                    get<0>(inputParticleHists["gamma"])->Integral() / launchedPrimariesMap.at("gamma"));
-        }
-        if (launchedPrimariesMap["proton"] > 0) {
-            protonsEnergy->Scale(get<1>(inputParticleHists["proton"])->Integral() / launchedPrimariesMap.at("proton"));
-            protonsZenith->Scale(get<2>(inputParticleHists["proton"])->Integral() / launchedPrimariesMap.at("proton"));
-            protonsEnergyZenith->Scale(
-                    get<0>(inputParticleHists["proton"])->Integral() / launchedPrimariesMap.at("proton"));
+    if (HitRecorder::IsEnabled()) {
+        HitRecorder::Flush();
+    }
+
+    if (!IsMaster()) {
+        // workers finish their runs before the master, merge once per thread instead of locking on every hit
+        const auto lockOutput = Metrics::Lock(outputMutex);
+        outputHistograms->Add(*threadOutputHistograms);
+        delete threadOutputHistograms;
+        threadOutputHistograms = nullptr;
+        if (threadAlbedoHistograms != nullptr) {
+            albedoHistograms->Add(*threadAlbedoHistograms);
+            delete threadAlbedoHistograms;
+            threadAlbedoHistograms = nullptr;
         }
-        if (launchedPrimariesMap["neutron"] > 0) {
-            neutronsEnergy->Scale(
-                    get<1>(inputParticleHists["neutron"])->Integral() / launchedPrimariesMap.at("neutron"));
-            neutronsZenith->Scale(
-                    get<2>(inputParticleHists["neutron"])->Integral() / launchedPrimariesMap.at("neutron"));
-            neutronsEnergyZenith->Scale(
-                    get<0>(inputParticleHists["neutron"])->Integral() / launchedPrimariesMap.at("neutron"));
+        return;
+    }
+
+    // all the workers are done, nothing left to snapshot
+    Checkpoint::Stop();
+
+    lock_guard<std::mutex> lockInput(inputMutex);
+    lock_guard<std::mutex> lockOutput(outputMutex);
+
+    RawResults results;
+    results.histograms.reset(outputHistograms);
+    outputHistograms = nullptr;
+    threadOutputHistograms = nullptr;
+
+    for (const auto particle: inputParticlesAll) {
+        results.launchedPrimaries[ToIndex(particle)] = GetLaunchedPrimaries(particle);
+    }
+    results.secondaries = GetSecondariesCount();
+    if (const auto resumeState = Checkpoint::GetResumeState()) {
+        // the counters already include the checkpoint
+        results.histograms->Add(*resumeState->histograms);
+    }
+
+    cout << "Total launched primaries: " << results.GetLaunchedPrimaries() << endl;
+    cout << "Total secondaries: " << results.secondaries << endl;
+    if (StackingAction::IsRangeRejectionEnabled()) {
+        StackingAction::PrintSummary();
+    }
+
+    TDirectory *directory = job.outputFile;
+    if (!job.outputDirectoryName.empty()) {
+        directory = job.outputFile->mkdir(job.outputDirectoryName.c_str(), job.outputDirectoryTitle.c_str());
+        if (directory == nullptr) {
+            throw runtime_error("RunAction::EndOfRunAction: could not create output directory " +
+                                job.outputDirectoryName);
         }
+    }
 
-        cout << "Total launched primaries: " << GetLaunchedPrimaries(false) << endl;
-        cout << "Total secondaries: " << GetSecondariesCount(false) << endl;
+    if (ResponseMatrix::IsEnabled()) {
+        // the primaries do not follow the input distribution, only the matrices are meaningful. They are folded with
+        // an input spectrum by 'radiation-transmission-fold'
+        ResponseMatrix::Write(directory);
+        TNamed("detector", job.outputDirectoryTitle.c_str()).Write();
+        return;
+    }
 
-        cout << "Secondaries flux (counts / s / m2): "
-             << muonsEnergyZenith->Integral() + electronsEnergyZenith->Integral() +
-                gammasEnergyZenith->Integral() + protonsEnergyZenith->Integral() +
-                neutronsEnergyZenith->Integral() << endl;
-        cout << "    - muons: " << muonsEnergyZenith->Integral() << endl;
-        cout << "    - electrons: " << electronsEnergyZenith->Integral() << endl;
-        cout << "    - gammas: " << gammasEnergyZenith->Integral() << endl;
-        cout << "    - protons: " << protonsEnergyZenith->Integral() << endl;
-        cout << "    - neutrons: " << neutronsEnergyZenith->Integral() << endl;
+    if (job.shardsN > 0) {
+        // shards are normalised once all of them are merged, see 'radiation-transmission-merge'
+        results.Write(directory);
+        TNamed("detector", job.outputDirectoryTitle.c_str()).Write();
+        AdaptiveStopping::Write(directory);
+        return;
+    }
 
+    for (const auto particle: inputParticlesAll) {
+        const auto &[inputEnergyZenith, inputEnergy, inputZenith] = inputParticleHists[GetInputParticleName(particle)];
+        results.Normalize(particle, *inputEnergyZenith, *inputEnergy, *inputZenith);
+    }
 
-        auto latitudeNamed = inputFile->Get<TNamed>("latitude");
-        latitudeNamed->Write();
+    cout << "Secondaries flux (counts / s / m2): " << results.histograms->GetIntegral() << endl;
+    for (const auto particle: {InputParticle::muon, InputParticle::electron, InputParticle::gamma,
+                               InputParticle::proton, InputParticle::neutron}) {
+        cout << "    - " << GetInputParticleName(particle) << "s: " << results.histograms->GetIntegral(particle)
+             << endl;
+    }
 
-        // write input hists
-        for (const auto &entry: inputParticleHists) {
-            get<1>(entry.second)->Write();
-            get<2>(entry.second)->Write();
-            get<0>(entry.second)->Write(); // write this last to keep consistent style
+    results.histograms->Write(directory);
+    AdaptiveStopping::Write(directory);
+
+    if (albedoEnabled) {
+        // same normalisation as the transmitted particles, the albedo is a flux per unit area of the front face
+        RawResults albedo;
+        albedo.histograms.reset(albedoHistograms);
+        albedoHistograms = nullptr;
+        threadAlbedoHistograms = nullptr;
+        albedo.launchedPrimaries = results.launchedPrimaries;
+        for (const auto particle: inputParticlesAll) {
+            const auto &[inputEnergyZenith, inputEnergy, inputZenith] = inputParticleHists[GetInputParticleName(particle)];
+            albedo.Normalize(particle, *inputEnergyZenith, *inputEnergy, *inputZenith);
         }
+        cout << "Albedo flux (counts / s / m2): " << albedo.histograms->GetIntegral() << endl;
+        albedo.histograms->Write(directory->mkdir("albedo", "Particles leaving the stack through its front face"));
+    }
+}
+
+void RunAction::EndJob() {
+    // whatever happens to the output, the next job starts from a fresh context
+    const auto endedJob = std::move(job);
+    job = {};
+    delete outputHistograms;
+    outputHistograms = nullptr;
+    delete albedoHistograms;
+    albedoHistograms = nullptr;
+
+    const auto outputFile = endedJob.outputFile;
+    if (outputFile == nullptr) {
+        return;
+    }
 
-        inputFile->Close();
+    outputFile->cd();
 
-        outputFile->Write();
-        outputFile->Close();
+    inputLatitude->Write();
+
+    TNamed("physics", physicsDescription.c_str()).Write();
+
+    if (endedJob.shardsN > 0) {
+        TParameter<Long64_t>("random_seed", endedJob.shardRandomSeed).Write();
+        TParameter<Long64_t>("shard", endedJob.shardIndex).Write();
+        TParameter<Long64_t>("shards", endedJob.shardsN).Write();
+    }
+
+    // write input hists
+    for (const auto &entry: inputParticleHists) {
+        get<1>(entry.second)->Write();
+        get<2>(entry.second)->Write();
+        get<0>(entry.second)->Write(); // write this last to keep consistent style
     }
+
+    outputFile->Write();
+    outputFile->Close();
+    delete outputFile;
 }
 
 void RunAction::InsertTrack(const G4Track *track) {
-    lock_guard<std::mutex> lock(outputMutex);
+    const auto slot = outputParticleSlots.find(track->GetParticleDefinition());
+    if (slot == outputParticleSlots.end()) {
+        return;
+    }
 
-    auto *particle = const_cast<G4ParticleDefinition *>(track->GetParticleDefinition());
-    G4String particleName = particle->GetParticleName();
     // Energy in MeV
-    G4double kineticEnergy = track->GetKineticEnergy() / MeV;
-    G4double zenith =
-            TMath::ACos(track->GetMomentumDirection().z()) * TMath::RadToDeg();
-
-    // TODO: split mu- and e-
-    if (particleName == "mu-" || particleName == "mu+") {
-        muonsEnergy->Fill(kineticEnergy);
-        muonsZenith->Fill(zenith);
-        muonsEnergyZenith->Fill(kineticEnergy, zenith);
-    } else if (particleName == "e-" || particleName == "e+") {
-        electronsEnergy->Fill(kineticEnergy);
-        electronsZenith->Fill(zenith);
-        electronsEnergyZenith->Fill(kineticEnergy, zenith);
-    } else if (particleName == "gamma") {
-        gammasEnergy->Fill(kineticEnergy);
-        gammasZenith->Fill(zenith);
-        gammasEnergyZenith->Fill(kineticEnergy, zenith);
-    } else if (particleName == "proton") {
-        protonsEnergy->Fill(kineticEnergy);
-        protonsZenith->Fill(zenith);
-        protonsEnergyZenith->Fill(kineticEnergy, zenith);
-    } else if (particleName == "neutron") {
-        neutronsEnergy->Fill(kineticEnergy);
-        neutronsZenith->Fill(zenith);
-        neutronsEnergyZenith->Fill(kineticEnergy, zenith);
-    } else {
-        return;
+    const G4double kineticEnergy = track->GetKineticEnergy() / MeV;
+    const G4double cosZenith = track->GetMomentumDirection().z();
+
+    // histograms are thread local, no locking required. The weight is only different from 1 with importance biasing
+    threadOutputHistograms->Fill(slot->second, kineticEnergy, cosZenith, track->GetWeight());
+
+    if (HitRecorder::IsEnabled()) {
+        HitRecorder::Record(slot->second, track);
     }
 
-    if (requestedSecondaries > 0 && GetSecondariesCount(false) >= requestedSecondaries) {
-        G4RunManager::GetRunManager()->AbortRun(true);
+    threadEventHits++;
+    Metrics::CountHit(slot->second);
+    AdaptiveStopping::AddHit(slot->second, track->GetWeight());
+
+    if (ResponseMatrix::IsEnabled()) {
+        const G4double zenith = TMath::ACos(cosZenith) * TMath::RadToDeg();
+        ResponseMatrix::Fill(slot->second, kineticEnergy, zenith, track->GetWeight());
     }
 }
 
-std::pair<double, double> RunAction::GenerateEnergyAndZenith(const string &particle) {
-    double energy, zenith;
+void RunAction::InsertAlbedo(const G4Track *track) {
+    const auto slot = outputParticleSlots.find(track->GetParticleDefinition());
+    if (slot == outputParticleSlots.end()) {
+        return;
+    }
+
+    // the track is at the exit point, moving up: the zenith is measured from the upward vertical
+    const G4double kineticEnergy = track->GetKineticEnergy() / MeV;
+    threadAlbedoHistograms->Fill(slot->second, kineticEnergy, -track->GetMomentumDirection().z(), track->GetWeight());
+}
+
+void RunAction::SetAlbedo(bool enabled) {
+    albedoEnabled = enabled;
+}
+
+void RunAction::SetEventPrimary(InputParticle particle) {
+    threadEventPrimary = particle;
+}
 
-    lock_guard<std::mutex> lock(inputMutex);
+void RunAction::EndOfEvent(const G4Event *) {
+    // runs are only ever stopped softly (see below), so every event reaching this point was fully processed
+    IncreaseLaunchedPrimaries(threadEventPrimary);
 
-    const auto hist = get<0>(inputParticleHists[particle]);
+    const auto count = secondariesCount.fetch_add(threadEventHits, memory_order_relaxed) + threadEventHits;
+    threadLaunchedPrimaries[ToIndex(threadEventPrimary)]++;
+    threadSecondaries += threadEventHits;
+    threadEventHits = 0;
+    Metrics::CountEvent();
 
-    hist->GetRandom2(energy, zenith);
+    if (ResponseMatrix::IsEnabled()) {
+        ResponseMatrix::EndOfEvent();
+    }
 
-    return {energy, zenith};
+    if (Checkpoint::IsSnapshotRequested()) {
+        Checkpoint::Snapshot(*threadOutputHistograms, threadLaunchedPrimaries, threadSecondaries);
+    }
+
+    // the precision / time criteria stop all the threads, each one at the end of its current event
+    const bool converged = AdaptiveStopping::EndOfEvent();
+
+    if (converged || (job.requestedSecondaries > 0 && count >= (unsigned long long) job.requestedSecondaries)) {
+        // soft abort of this thread's run manager: the event loop stops before starting the next event. Each worker
+        // stops on its own at the end of its current event, so the run never contains partially processed events, and
+        // the limit is overshot by up to one event per thread. The task-based workers only check after an event, a task
+        // started on a stopped worker still processes one event (and stops it again here) before it returns
+        G4RunManager::GetRunManager()->AbortRun(true);
+    }
+}
+
+std::pair<double, double> RunAction::GenerateEnergyAndZenith(InputParticle particle) {
+    // the sampler is immutable and the random engine is thread local, no locking required
+    const auto &sampler = *inputParticleSamplers[ToIndex(particle)];
+
+    const double randomBin = G4UniformRand();
+    const double randomEnergy = G4UniformRand();
+    const double randomZenith = G4UniformRand();
+
+    if (ResponseMatrix::IsEnabled()) {
+        return ResponseMatrix::Sample(particle, randomBin, randomEnergy, randomZenith);
+    }
+    return sampler.Sample(randomBin, randomEnergy, randomZenith);
 }
 
 std::string RunAction::GetGeant4ParticleName(const std::string &particleName) {
@@ -325,81 +461,69 @@ std::string RunAction::GetGeant4ParticleName(const std::string &particleName) {
     }
 }
 
-void RunAction::SetInputParticles(const std::set<std::string> &particleNames) {
-    inputParticleNames = particleNames;
+G4ParticleDefinition *RunAction::GetInputParticleDefinition(InputParticle particle) {
+    return inputParticleDefinitions[ToIndex(particle)];
 }
 
 void RunAction::SetInputFilename(const string &name) {
     inputFilename = name;
 }
 
-void RunAction::SetOutputFilename(const string &name) {
-    outputFilename = name;
+void RunAction::BeginJob(JobContext newJob) {
+    job = std::move(newJob);
 }
 
-void RunAction::SetRequestedPrimaries(int newValue) {
-    RunAction::requestedPrimaries = newValue;
+void RunAction::SetOutputDirectory(const string &name, const string &title) {
+    job.outputDirectoryName = name;
+    job.outputDirectoryTitle = title;
 }
 
-void RunAction::SetRequestedSecondaries(int newValue) {
-    RunAction::requestedSecondaries = newValue;
+void RunAction::SetPhysicsDescription(const string &description) {
+    physicsDescription = description;
 }
 
 int RunAction::GetRequestedPrimaries() {
-    return RunAction::requestedPrimaries;
+    return job.requestedPrimaries;
 }
 
 int RunAction::GetRequestedSecondaries() {
-    return RunAction::requestedSecondaries;
+    return job.requestedSecondaries;
 }
 
-unsigned long long RunAction::GetSecondariesCount(bool lock) {
-    if (muonsEnergyZenith == nullptr || electronsEnergyZenith == nullptr || gammasEnergyZenith == nullptr ||
-        protonsEnergyZenith == nullptr || neutronsEnergyZenith == nullptr) {
-        return 0;
-    }
-
-    if (lock) {
-        outputMutex.lock();
-    }
-    auto count = muonsEnergyZenith->GetEntries() + electronsEnergyZenith->GetEntries() +
-                 gammasEnergyZenith->GetEntries() + protonsEnergyZenith->GetEntries() +
-                 neutronsEnergyZenith->GetEntries();
-    if (lock) {
-        outputMutex.unlock();
-    }
-    return count;
+unsigned long long RunAction::GetSecondariesCount() {
+    return secondariesCount.load(memory_order_relaxed);
 }
 
-void RunAction::IncreaseLaunchedPrimaries(const string &particleName) {
-    lock_guard<std::mutex> lock(inputMutex);
-    RunAction::launchedPrimariesMap[particleName]++;
+void RunAction::IncreaseLaunchedPrimaries(InputParticle particle) {
+    launchedPrimaries[ToIndex(particle)].value.fetch_add(1, memory_order_relaxed);
 }
 
-unsigned int RunAction::GetLaunchedPrimaries(bool lock) {
-    if (lock) {
-        inputMutex.lock();
-    }
-    auto count = std::accumulate(launchedPrimariesMap.begin(), launchedPrimariesMap.end(), 0,
-                                 [](unsigned int sum, const auto &entry) { return sum + entry.second; });
-    if (lock) {
-        inputMutex.unlock();
+unsigned long long RunAction::GetLaunchedPrimaries() {
+    unsigned long long count = 0;
+    for (const auto &counter: launchedPrimaries) {
+        count += counter.value.load(memory_order_relaxed);
     }
     return count;
 }
 
-std::string RunAction::ChooseParticle() {
-    lock_guard<std::mutex> lock(inputMutex);
+unsigned long long RunAction::GetLaunchedPrimaries(InputParticle particle) {
+    return launchedPrimaries[ToIndex(particle)].value.load(memory_order_relaxed);
+}
 
-    if (inputParticleNames.size() == 1) {
-        return *inputParticleNames.begin();
+InputParticle RunAction::ChooseParticle() {
+    // the cumulative weights are only written by the master before the run starts, no locking required
+    if (job.inputParticlesCumulativeWeights.size() == 1) {
+        return job.inputParticlesCumulativeWeights.front().first;
+    } else if (ResponseMatrix::IsEnabled()) {
+        // each species gets its own matrix, normalised on its own when folding, the input weights do not matter
+        const auto index = min<size_t>(size_t(G4UniformRand() * double(job.inputParticlesCumulativeWeights.size())),
+                                       job.inputParticlesCumulativeWeights.size() - 1);
+        return job.inputParticlesCumulativeWeights[index].first;
     } else {
         const auto random = G4UniformRand();
         // choose a random particle based on the weights
-        double sum = 0;
-        for (const auto &particle: inputParticleNames) {
-            sum += inputParticleWeights[particle];
-            if (random <= sum) {
+        for (const auto &[particle, cumulativeWeight]: job.inputParticlesCumulativeWeights) {
+            if (random <= cumulativeWeight) {
                 return particle;
             }
         }
@@ -1,13 +1,27 @@
 
 #pragma once
 
+#include <G4Event.hh>
 #include <G4RunManager.hh>
 #include <G4UserRunAction.hh>
 
 #include <TFile.h>
+#include <TNamed.h>
 #include <TH1D.h>
 #include <TH2D.h>
 
+#include "CompiledInput.h"
+#include "EnergyZenithSampler.h"
+#include "InputParticle.h"
+#include "JobContext.h"
+#include "OutputHistograms.h"
+#include "RawResults.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
 class RunAction : public G4UserRunAction {
 public:
     RunAction();
@@ -18,73 +32,115 @@ public:
 
     static void InsertTrack(const G4Track *track);
 
-    static std::pair<double, double> GenerateEnergyAndZenith(const std::string &particle);
+    // particle leaving the stack back through its front face, called when the track is killed on exit
+    static void InsertAlbedo(const G4Track *track);
+
+    // backward leaving particles are scored into the 'albedo' directory of each output directory
+    static void SetAlbedo(bool enabled);
+
+    static bool IsAlbedoEnabled() { return albedoEnabled; }
+
+    static std::pair<double, double> GenerateEnergyAndZenith(InputParticle particle);
 
-    static std::string ChooseParticle();
+    static InputParticle ChooseParticle();
 
     static std::string GetGeant4ParticleName(const std::string &particleName); // electron -> e-, etc.
 
-    static void SetInputParticles(const std::set<std::string> &particleNames);
+    static G4ParticleDefinition *GetInputParticleDefinition(InputParticle particle);
 
     static void SetInputFilename(const std::string &inputFilename);
 
-    static void SetOutputFilename(const std::string &outputFilename);
+    // reads the input distributions, master, once the particle table is built. Done by the first run otherwise
+    static void LoadInput();
 
-    static void SetRequestedPrimaries(int);
+    // samplers of these input particles, built before the workers start and then only read. Master, between runs
+    static void BuildSamplers(const std::set<std::string> &particleNames);
 
-    static int GetRequestedPrimaries();
+    // physics configuration used, written into the output files
+    static void SetPhysicsDescription(const std::string &description);
+
+    // the following runs belong to this job, until EndJob. Master, between runs
+    static void BeginJob(JobContext newJob);
+
+    // results of the following runs are written into this directory of the output file (top level if empty), the
+    // title describes the detector configuration
+    static void SetOutputDirectory(const std::string &name, const std::string &title = "");
 
-    static void SetRequestedSecondaries(int);
+    // writes the input information, closes the output file and discards the job, must be called once after the last
+    // run of the job
+    static void EndJob();
+
+    static int GetRequestedPrimaries();
 
     static int GetRequestedSecondaries();
 
-    static void IncreaseLaunchedPrimaries(const std::string &);
+    static void SetEventPrimary(InputParticle);
 
-    static unsigned int GetLaunchedPrimaries(bool lock = true);
+    // accounts the primary and the hits of a fully processed event, and stops the thread once the requested
+    // number of secondaries is reached
+    static void EndOfEvent(const G4Event *);
 
-    static unsigned long long GetSecondariesCount(bool lock = true);
+    static unsigned long long GetLaunchedPrimaries();
+
+    static unsigned long long GetLaunchedPrimaries(InputParticle);
+
+    static unsigned long long GetSecondariesCount();
 
     static std::set<std::string> GetInputParticlesAllowed() {
         return inputParticleNamesAllowed;
     }
 
 private:
-    static int requestedPrimaries;
-    static int requestedSecondaries;
+    // one counter per cache line, updated once per event and read without locking by the progress report
+    struct alignas(64) PaddedCounter {
+        std::atomic<unsigned long long> value = 0;
+    };
+
+    static std::array<PaddedCounter, inputParticlesN> launchedPrimaries;
+
+    static void IncreaseLaunchedPrimaries(InputParticle);
+
+    // state of the event being processed by this thread, only committed at the end of the event
+    static G4ThreadLocal InputParticle threadEventPrimary;
+    static G4ThreadLocal unsigned long long threadEventHits;
 
-    static std::map<std::string, double> launchedPrimariesMap;
+    // totals of the events processed by this thread in the current run, copied into the checkpoints
+    static G4ThreadLocal std::array<unsigned long long, inputParticlesN> threadLaunchedPrimaries;
+    static G4ThreadLocal unsigned long long threadSecondaries;
+
+    // weights of the selected particles of the job, master before its first run
+    static void PrepareJob();
+
+    static JobContext job;
 
     static std::string inputFilename;
-    static std::string outputFilename;
+    static std::string physicsDescription;
 
     static std::mutex inputMutex;
     static std::mutex outputMutex;
 
-    static std::set<std::string> inputParticleNames;
-    static TFile *inputFile;
-    static TFile *outputFile;
+    // the input is shared by all the jobs of the process
+    static TFile *inputFile; // nullptr for a compiled input
+    static std::unique_ptr<CompiledInput> compiledInput; // mapped for the lifetime of the samplers
+    static TNamed *inputLatitude;
 
     static std::map<std::string, std::tuple<TH2D *, TH1D *, TH1D *>> inputParticleHists;
-    static std::map<std::string, double> inputParticleWeights; // based on the counts in the input histograms
+    static std::array<std::unique_ptr<EnergyZenithSampler>, inputParticlesN> inputParticleSamplers; // read-only during the run
+    static std::map<std::string, double> inputParticleEntries; // counts in the input histograms
     static std::set<std::string> inputParticleNamesAllowed;
 
-    static TH1D *muonsEnergy;
-    static TH1D *electronsEnergy;
-    static TH1D *gammasEnergy;
-    static TH1D *protonsEnergy;
-    static TH1D *neutronsEnergy;
-
-    static TH1D *muonsZenith;
-    static TH1D *electronsZenith;
-    static TH1D *gammasZenith;
-    static TH1D *protonsZenith;
-    static TH1D *neutronsZenith;
-
-    static TH2D *muonsEnergyZenith;
-    static TH2D *electronsEnergyZenith;
-    static TH2D *gammasEnergyZenith;
-    static TH2D *protonsEnergyZenith;
-    static TH2D *neutronsEnergyZenith;
+    static OutputHistograms *outputHistograms; // merged results of all threads, written to the output file
+    static G4ThreadLocal OutputHistograms *threadOutputHistograms; // filled by the thread processing the events
+
+    static bool albedoEnabled;
+    static OutputHistograms *albedoHistograms; // as the output histograms, zenith measured from the upward vertical
+    static G4ThreadLocal OutputHistograms *threadAlbedoHistograms;
+
+    static std::atomic<unsigned long long> secondariesCount;
+
+    // built once by the master, read-only during the run
+    static std::unordered_map<const G4ParticleDefinition *, OutputParticle> outputParticleSlots;
+    static std::array<G4ParticleDefinition *, inputParticlesN> inputParticleDefinitions;
 };
 
 
@@ -0,0 +1,153 @@
+#include "StackingAction.h"
+
+#include <G4ParticleTable.hh>
+#include <G4SystemOfUnits.hh>
+#include <G4Track.hh>
+
+#include <bit>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+using namespace CLHEP;
+
+map<string, double> StackingAction::rangeRejectionMargins = {};
+vector<unique_ptr<StackingAction::Species>> StackingAction::species = {};
+vector<DetectorConstruction::Layer> StackingAction::layers = {};
+double StackingAction::detectorPosition = 0;
+
+namespace {
+G4ThreadLocal long long trackingStart = 0;
+
+// a track is a sample depending on its energy alone, so that the results of an event do not depend on the thread
+bool IsSample(double energy, unsigned long long interval) {
+    auto bits = bit_cast<uint64_t>(energy);
+    bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9;
+    bits = (bits ^ (bits >> 27)) * 0x94d049bb133111eb;
+    bits = bits ^ (bits >> 31);
+    return bits % interval == 0;
+}
+
+long long ThreadCpuNanoseconds() {
+    timespec time = {};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (long long) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+} // namespace
+
+StackingAction::StackingAction() : G4UserStackingAction() {}
+
+void StackingAction::SetRangeRejection(const map<string, double> &particleMargins) {
+    rangeRejectionMargins = particleMargins;
+}
+
+void StackingAction::BeginOfRun(const DetectorConstruction &detector) {
+    layers = detector.GetLayers();
+    detectorPosition = detector.GetDetectorPosition();
+
+    species.clear();
+    const auto particleTable = G4ParticleTable::GetParticleTable();
+    for (const auto &[particleName, margin]: rangeRejectionMargins) {
+        auto entry = make_unique<Species>();
+        if (particleName != "GenericIon") {
+            entry->particle = particleTable->FindParticle(particleName);
+            if (entry->particle == nullptr) {
+                throw runtime_error("StackingAction::BeginOfRun: unknown particle " + particleName);
+            }
+            // a neutral particle has no restricted range, all of them would be killed
+            if (entry->particle->GetPDGCharge() == 0) {
+                throw runtime_error("StackingAction::BeginOfRun: range rejection needs a charged particle, not " +
+                                    particleName);
+            }
+        }
+        entry->margin = margin;
+        species.push_back(std::move(entry));
+    }
+}
+
+StackingAction::Species *StackingAction::FindSpecies(const G4ParticleDefinition *particle) const {
+    const auto isIon = particle->IsGeneralIon();
+    for (const auto &entry: species) {
+        if (entry->particle == particle || (entry->particle == nullptr && isIon)) {
+            return entry.get();
+        }
+    }
+    return nullptr;
+}
+
+G4ClassificationOfNewTrack StackingAction::ClassifyNewTrack(const G4Track *track) {
+    if (track->GetParentID() == 0 || layers.empty()) {
+        return fUrgent;
+    }
+
+    const auto particle = track->GetParticleDefinition();
+    const auto entry = FindSpecies(particle);
+    if (entry == nullptr) {
+        return fUrgent;
+    }
+
+    const auto z = track->GetPosition().z();
+    if (z < layers.front().start || z >= detectorPosition) {
+        return fUrgent;
+    }
+
+    // the track has to cross at least the rest of the stack, through any of the remaining materials. The range from
+    // the restricted stopping power is longer than the CSDA range, which keeps the rejection conservative
+    const auto distance = detectorPosition - z;
+    const auto energy = track->GetKineticEnergy();
+    double range = 0;
+    for (const auto &layer: layers) {
+        if (layer.end <= z) {
+            continue;
+        }
+        range = max(range, calculator.GetRangeFromRestricteDEDX(energy, particle, layer.material));
+    }
+
+    if (range * (1 + entry->margin) >= distance) {
+        return fUrgent;
+    }
+
+    if (IsSample(energy, sampleInterval)) {
+        // the track is not modified otherwise, its results are the ones it would have without rejection
+        const_cast<G4Track *>(track)->SetUserInformation(new Sample(entry));
+        return fUrgent;
+    }
+
+    entry->killed.fetch_add(1, memory_order_relaxed);
+    entry->killedEnergy.fetch_add(energy, memory_order_relaxed);
+    return fKill;
+}
+
+void StackingAction::BeginTracking(const G4Track *track) {
+    if (dynamic_cast<const Sample *>(track->GetUserInformation()) != nullptr) {
+        trackingStart = ThreadCpuNanoseconds();
+    }
+}
+
+void StackingAction::EndTracking(const G4Track *track) {
+    const auto sample = dynamic_cast<const Sample *>(track->GetUserInformation());
+    if (sample == nullptr) {
+        return;
+    }
+    sample->species->sampled.fetch_add(1, memory_order_relaxed);
+    sample->species->sampledNanoseconds.fetch_add(ThreadCpuNanoseconds() - trackingStart, memory_order_relaxed);
+}
+
+void StackingAction::PrintSummary() {
+    cout << "Range rejection:" << endl;
+    for (const auto &entry: species) {
+        cout << "    - " << (entry->particle != nullptr ? entry->particle->GetParticleName() : "ions") << ": "
+             << entry->killed << " tracks killed, " << entry->killedEnergy / MeV << " MeV not tracked";
+        // an estimate: the mean CPU time of the sampled tracks times the killed ones. The secondaries the killed tracks
+        // would have produced are not included, nor is the time of the range calculation itself
+        if (entry->sampled > 0) {
+            const double meanSeconds = 1E-9 * double(entry->sampledNanoseconds) / double(entry->sampled);
+            cout << ", about " << meanSeconds * double(entry->killed) << " s of CPU saved (estimated from "
+                 << entry->sampled << " sampled tracks, " << 1E6 * meanSeconds << " us each)";
+        } else {
+            cout << ", CPU saved not estimated (no track sampled)";
+        }
+        cout << endl;
+    }
+}
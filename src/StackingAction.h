@@ -0,0 +1,67 @@
+#pragma once
+
+#include <G4EmCalculator.hh>
+#include <G4UserStackingAction.hh>
+#include <G4VUserTrackInformation.hh>
+
+#include "DetectorConstruction.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Optional range rejection: secondaries whose residual range is shorter than their distance to the detector plane
+// can never be scored and are killed as soon as they are created. About one in every 'sampleInterval' of them is tracked
+// anyway and its CPU time measured, to estimate the time the rejection saves
+class StackingAction : public G4UserStackingAction {
+public:
+    StackingAction();
+
+    G4ClassificationOfNewTrack ClassifyNewTrack(const G4Track *) override;
+
+    // Geant4 particle name ("GenericIon" for all ions) and relative safety margin on the range
+    static void SetRangeRejection(const std::map<std::string, double> &particleMargins);
+
+    static bool IsRangeRejectionEnabled() { return !rangeRejectionMargins.empty(); }
+
+    // master, before each run: takes the layers of the current geometry and resets the counters
+    static void BeginOfRun(const DetectorConstruction &detector);
+
+    static void PrintSummary();
+
+    // tracking action, times the tracks kept as samples
+    static void BeginTracking(const G4Track *track);
+
+    static void EndTracking(const G4Track *track);
+
+private:
+    static constexpr unsigned long long sampleInterval = 1000;
+
+    struct Species {
+        const G4ParticleDefinition *particle = nullptr; // nullptr for all the ions
+        double margin = 0;
+        std::atomic<unsigned long long> killed = 0;
+        std::atomic<double> killedEnergy = 0;
+        // tracks that would have been killed, tracked anyway, and their CPU time
+        std::atomic<unsigned long long> sampled = 0;
+        std::atomic<long long> sampledNanoseconds = 0;
+    };
+
+    // marks a sample, deleted with its track
+    struct Sample : public G4VUserTrackInformation {
+        explicit Sample(Species *species) : species(species) {}
+
+        Species *species;
+    };
+
+    Species *FindSpecies(const G4ParticleDefinition *particle) const;
+
+    G4EmCalculator calculator;
+
+    static std::map<std::string, double> rangeRejectionMargins;
+    static std::vector<std::unique_ptr<Species>> species; // built by the master, only the counters change
+    static std::vector<DetectorConstruction::Layer> layers;
+    static double detectorPosition;
+};
@@ -1,37 +1,47 @@
 
 #include "SteppingAction.h"
 
+#include "Metrics.h"
 #include "RunAction.h"
 
 #include <G4Step.hh>
+#include <G4SystemOfUnits.hh>
 
 using namespace std;
 
 
+bool SteppingAction::killOnExit = false;
+bool SteppingAction::scoringPlane = false;
+double SteppingAction::scoringPlanePosition = 0;
+
 SteppingAction::SteppingAction() : G4UserSteppingAction() {}
 
+void SteppingAction::BeginOfRun(const DetectorConstruction &detector) {
+    scoringPlane = detector.IsScoringPlane();
+    scoringPlanePosition = detector.GetDetectorPosition();
+}
+
 void SteppingAction::UserSteppingAction(const G4Step *step) {
-    return;
-    // print step info
-    G4StepPoint *preStepPoint = step->GetPreStepPoint();
-    G4StepPoint *postStepPoint = step->GetPostStepPoint();
-    G4Track *track = step->GetTrack();
-    G4ParticleDefinition *particle = const_cast<G4ParticleDefinition *>(track->GetParticleDefinition());
-    G4String particleName = particle->GetParticleName();
-    G4String volumeName = preStepPoint->GetPhysicalVolume()->GetName();
-    G4double stepLength = step->GetStepLength();
-    G4double energyDeposit = step->GetTotalEnergyDeposit();
-    G4double globalTime = track->GetGlobalTime();
-    G4double kineticEnergy = track->GetKineticEnergy();
-    G4ThreeVector position = preStepPoint->GetPosition();
-    G4ThreeVector momentum = track->GetMomentumDirection();
-    cout << "SteppingAction::UserSteppingAction: "
-         << "particle=" << particleName << " "
-         << "volume=" << volumeName << " "
-         << "stepLength=" << stepLength << " "
-         << "energyDeposit=" << energyDeposit << " "
-         << "globalTime=" << globalTime << " "
-         << "kineticEnergy=" << kineticEnergy << " "
-         << "position=" << position << " "
-         << "momentum=" << momentum << endl;
+    Metrics::CountStep();
+
+    const auto postStepPoint = step->GetPostStepPoint();
+    if ((scoringPlane || killOnExit) && postStepPoint->GetStepStatus() == fGeomBoundary) {
+        // entering the world volume, the only one without a mother, means leaving the stack
+        const auto volume = postStepPoint->GetPhysicalVolume();
+        if (volume != nullptr && volume->GetMotherLogical() == nullptr) {
+            const auto track = step->GetTrack();
+            const auto z = postStepPoint->GetPosition().z();
+            if (scoringPlane && z > scoringPlanePosition - 1 * um) {
+                // through the exit surface, scored as by the sensitive detector
+                RunAction::InsertTrack(track);
+                track->SetTrackStatus(fStopAndKill);
+            } else if (killOnExit) {
+                // the stack starts at z = 0, anything else leaves through the far away sides
+                if (RunAction::IsAlbedoEnabled() && z < 1 * um && postStepPoint->GetMomentumDirection().z() < 0) {
+                    RunAction::InsertAlbedo(track);
+                }
+                track->SetTrackStatus(fStopAndKill);
+            }
+        }
+    }
 }
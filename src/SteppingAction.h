@@ -3,13 +3,32 @@
 
 #include <G4UserSteppingAction.hh>
 
+#include "DetectorConstruction.h"
 
 
+
+// Optionally kills the tracks leaving the stack into the world: the world is vacuum, so a particle leaving through the
+// front face or the sides never comes back, and would otherwise be transported through kilometres of empty space.
+// The detector side is closed by the sensitive detector, which already kills everything reaching it, or by the scoring
+// plane: with DetectorConstruction::SetScoringPlane, the particles entering the world through the exit surface of the
+// last layer are scored and killed here, without a sensitive volume to navigate into
 class SteppingAction : public G4UserSteppingAction {
 public:
     SteppingAction();
 
     void UserSteppingAction(const G4Step*) override;
+
+    static void SetKillOnExit(bool enabled) { killOnExit = enabled; }
+
+    static bool IsKillOnExitEnabled() { return killOnExit; }
+
+    // master, before each run: takes the scoring plane of the current geometry
+    static void BeginOfRun(const DetectorConstruction &detector);
+
+private:
+    static bool killOnExit;
+    static bool scoringPlane;
+    static double scoringPlanePosition;
 };
 
 
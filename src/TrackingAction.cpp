@@ -1,6 +1,7 @@
 
 #include "TrackingAction.h"
 #include "RunAction.h"
+#include "StackingAction.h"
 
 #include <G4ParticleDefinition.hh>
 #include <G4SystemOfUnits.hh>
@@ -14,6 +15,9 @@ using namespace CLHEP;
 TrackingAction::TrackingAction() : G4UserTrackingAction() {}
 
 void TrackingAction::PreUserTrackingAction(const G4Track *track) {
+    if (StackingAction::IsRangeRejectionEnabled()) {
+        StackingAction::BeginTracking(track);
+    }
     return;
     // print track info
     G4ParticleDefinition *particle = const_cast<G4ParticleDefinition *>(track->GetParticleDefinition());
@@ -38,4 +42,8 @@ void TrackingAction::PreUserTrackingAction(const G4Track *track) {
          << "momentum=" << momentum << endl;
 }
 
-void TrackingAction::PostUserTrackingAction(const G4Track *track) {}
+void TrackingAction::PostUserTrackingAction(const G4Track *track) {
+    if (StackingAction::IsRangeRejectionEnabled()) {
+        StackingAction::EndTracking(track);
+    }
+}